@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dp2d.h"
 #include "fp.h"
@@ -20,14 +21,79 @@ static struct {
 	size_t lmax;
 	/* num items (to be removed later) */
 	size_t ni;
+	/* options for building the fp-tree */
+	struct fpt_options fpo;
+	/* print the shape and memory of the structures once done */
+	int profile;
 } args;
 
 static void usage(const char *prg)
 {
-	fprintf(stderr, "Usage: %s TFILE RMAX NI\n", prg);
+	fprintf(stderr, "Usage: %s [-j THREADS] [-p] [-b tree|bitmap] [-m PAIRS] [-c DIR [-V]] [-o DIR [-M MB]] [-P] TFILE RMAX NI\n", prg);
 	exit(EXIT_FAILURE);
 }
 
+/* keep in the fp-tree only the items the recall tree is built from */
+static size_t select_top_items(const struct fptree *fp, int *keep, void *arg)
+{
+	(void)arg;
+	return recall_top_items(fp, args.ni, keep);
+}
+
+static void parse_options(int *argc, char ***argv)
+{
+	char *prg = (*argv)[0];
+	int opt;
+
+	args.fpo.threads = 1;
+	while ((opt = getopt(*argc, *argv, "j:pb:m:c:Vo:M:P")) != -1)
+		switch (opt) {
+		case 'j':
+			if (sscanf(optarg, "%lu", &args.fpo.threads) != 1 ||
+					!args.fpo.threads)
+				usage(prg);
+			break;
+		case 'p':
+			args.fpo.select = select_top_items;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "tree"))
+				args.fpo.backend = FPT_TREE;
+			else if (!strcmp(optarg, "bitmap"))
+				args.fpo.backend = FPT_BITMAP;
+			else
+				usage(prg);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%lu", &args.fpo.pairs) != 1)
+				usage(prg);
+			break;
+		case 'c':
+			args.fpo.image_dir = optarg;
+			break;
+		case 'V':
+			args.fpo.image_verify = 1;
+			break;
+		case 'o':
+			args.fpo.part_dir = optarg;
+			break;
+		case 'M':
+			if (sscanf(optarg, "%lu", &args.fpo.part_mb) != 1)
+				usage(prg);
+			break;
+		case 'P':
+			args.profile = 1;
+			break;
+		default:
+			usage(prg);
+		}
+
+	/* leave only the positional arguments, after the program name */
+	*argc -= optind - 1;
+	*argv += optind - 1;
+	(*argv)[0] = prg;
+}
+
 static void parse_arguments(int argc, char **argv)
 {
 	int i;
@@ -37,6 +103,8 @@ static void parse_arguments(int argc, char **argv)
 		printf("%s ", argv[i]);
 	printf("\n");
 
+	parse_options(&argc, &argv);
+
 	if (argc != 4)
 		usage(argv[0]);
 	args.tfname = strdup(argv[1]);
@@ -46,6 +114,17 @@ static void parse_arguments(int argc, char **argv)
 		usage(argv[0]);
 }
 
+static void print_profile(const struct fptree *fp,
+		const struct itstree_node *itst)
+{
+	size_t tree = fpt_profile(fp, args.ni);
+	size_t its = itstree_bytes(itst);
+
+	printf("Heap: fp-tree %.1lf MiB, recall tree %.1lf MiB, total %.1lf MiB\n",
+			tree / 1048576.0, its / 1048576.0,
+			(tree + its) / 1048576.0);
+}
+
 int main(int argc, char **argv)
 {
 	struct itstree_node *itst;
@@ -53,12 +132,14 @@ int main(int argc, char **argv)
 
 	parse_arguments(argc, argv);
 
-	fpt_read_from_file(args.tfname, &fp);
+	fpt_read_from_file(args.tfname, &fp, &args.fpo);
 	printf("fp-tree: items: %lu, transactions: %lu, nodes: %d, depth: %d\n",
 			fp.n, fp.t, fpt_nodes(&fp), fpt_height(&fp));
 
 	itst = build_recall_tree(&fp, args.lmax, min(fp.n, args.ni));
 	save_its(itst, args.tfname, args.lmax, args.ni);
+	if (args.profile)
+		print_profile(&fp, itst);
 
 	free_itstree(itst);
 	fpt_cleanup(&fp);
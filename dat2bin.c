@@ -0,0 +1,68 @@
+/**
+ * Converter from text transaction files to the binary format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fp.h"
+
+/* Command line arguments */
+static struct {
+	/* filename containing the transactions */
+	char *tfname;
+	/* filename for the binary transactions */
+	char *bfname;
+	/* options for building the fp-tree */
+	struct fpt_options fpo;
+} args;
+
+static void usage(const char *prg)
+{
+	fprintf(stderr, "Usage: %s [-j THREADS] TFILE BFILE\n", prg);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_arguments(int argc, char **argv)
+{
+	int opt;
+
+	args.fpo.threads = 1;
+	/* only the tree is saved */
+	args.fpo.backend = FPT_TREE;
+	while ((opt = getopt(argc, argv, "j:")) != -1)
+		switch (opt) {
+		case 'j':
+			if (sscanf(optarg, "%lu", &args.fpo.threads) != 1 ||
+					!args.fpo.threads)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+
+	if (argc - optind != 2)
+		usage(argv[0]);
+	args.tfname = strdup(argv[optind]);
+	args.bfname = strdup(argv[optind + 1]);
+}
+
+int main(int argc, char **argv)
+{
+	struct fptree fp;
+
+	parse_arguments(argc, argv);
+
+	fpt_read_from_file(args.tfname, &fp, &args.fpo);
+	printf("fp-tree: items: %lu, transactions: %lu, nodes: %d, depth: %d\n",
+			fp.n, fp.t, fpt_nodes(&fp), fpt_height(&fp));
+	fpt_save_binary(&fp, args.bfname);
+
+	fpt_cleanup(&fp);
+	free(args.tfname);
+	free(args.bfname);
+
+	return 0;
+}
@@ -1,7 +1,9 @@
 #include <math.h>
+#include <pthread.h>
 #include <search.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "dp2d.h"
@@ -46,6 +48,15 @@
 #define EM_REDFUN max
 #endif
 
+/* nodes of the mining tree counted at once */
+#ifndef MINE_BATCH
+#define MINE_BATCH 256
+#endif
+/* leaves whose rules are counted at once */
+#ifndef MINE_JOBS
+#define MINE_JOBS 256
+#endif
+
 enum quality_fun {
 	EM_QD = 0,
 	EM_QDELTA,
@@ -54,6 +65,7 @@ enum quality_fun {
 static const enum quality_fun QMETHOD = EM_QSIGMA;
 
 struct item_count {
+	/* rank of the item in fp */
 	int value;
 	int real_count;
 	double noisy_count;
@@ -66,18 +78,30 @@ static int ic_noisy_cmp(const void *a, const void *b)
 }
 
 #if PRINT_ITEM_TABLE
-static inline void print_item_table(const struct item_count *ic, size_t n)
+static inline void print_item_table(const struct fptree *fp,
+		const struct item_count *ic, size_t n)
 {
 	size_t i;
 
 	printf("\n");
 	for (i = 0; i < n; i++)
-		printf("%5lu[%5.2lf] %5d %7d %9.2lf\n", i, (i + 1.0)/n,
-				ic[i].value, ic[i].real_count,
+		printf("%5lu[%5.2lf] %5lu %7d %9.2lf\n", i, (i + 1.0)/n,
+				fpt_item_id(fp, fpt_rank_item(fp, ic[i].value)),
+				ic[i].real_count,
 				ic[i].noisy_count);
 }
 #endif
 
+/**
+ * Budget to spend on a sample of the transactions for eps on the input,
+ * from the amplification by Poisson subsampling at rate q:
+ * eps = log(1 + q (e^eps_sample - 1)).
+ */
+static double sample_eps(const struct fptree *fp, double eps)
+{
+	return fp->q < 1 ? log1p(expm1(eps) / fp->q) : eps;
+}
+
 static size_t build_items_table(const struct fptree *fp, struct item_count *ic,
 		double eps, struct drand48_data *buffer)
 {
@@ -85,7 +109,7 @@ static size_t build_items_table(const struct fptree *fp, struct item_count *ic,
 
 	printf("Compute noisy counts for items with eps = %lf\n", eps);
 	for (i = 0; i < fp->n; i++) {
-		ic[i].value = i + 1;
+		ic[i].value = fpt_item_rank(fp, i + 1);
 		ic[i].real_count = fpt_item_count(fp, i);
 		ic[i].noisy_count = laplace_mechanism(ic[i].real_count, eps,
 				1, buffer);
@@ -96,7 +120,7 @@ static size_t build_items_table(const struct fptree *fp, struct item_count *ic,
 	qsort(ic, fp->n, sizeof(ic[0]), ic_noisy_cmp);
 
 #if PRINT_ITEM_TABLE
-	print_item_table(ic, fp->n);
+	print_item_table(fp, ic, fp->n);
 #endif
 
 	printf("Noise scale: %5.2f\n", SCALE_FACTOR/eps);
@@ -108,38 +132,51 @@ static size_t build_items_table(const struct fptree *fp, struct item_count *ic,
 }
 
 #if PRINT_FINAL_RULES
-static void print_this_rule(const int *A, const int* AB,
-		size_t a_length, size_t ab_length, double c)
+static void print_this_rule(const struct fptree *fp, const int *A,
+		const int* AB, size_t a_length, size_t ab_length, double c)
 {
 	size_t i, j;
 
 	for (i = 0; i < a_length; i++)
-		printf("%d ", A[i]);
+		printf("%lu ", fpt_item_id(fp, fpt_rank_item(fp, A[i])));
 	printf("-> ");
 	for (i = 0; i < ab_length; i++) {
 		for (j = 0; j < a_length; j++)
 			if (AB[i] == A[j])
 				j = 2 * a_length;
 		if (j == a_length)
-			printf("%d ", AB[i]);
+			printf("%lu ", fpt_item_id(fp,
+						fpt_rank_item(fp, AB[i])));
 	}
 	printf("| c=%7.6f\n", c);
 }
 #endif
 
+/**
+ * Ranks in its, as sorted ids of the transaction file in cf, the form used
+ * by the itstree: a sample holds fewer items, numbered apart from the file.
+ */
+static void ranks_to_items(const struct fptree *fp, const int *its,
+		size_t itslen, int *cf)
+{
+	size_t i;
+
+	for (i = 0; i < itslen; i++)
+		cf[i] = fpt_item_id(fp, fpt_rank_item(fp, its[i]));
+	qsort(cf, itslen, sizeof(cf[0]), int_cmp);
+}
+
 /**
  * Checks whether the current itemset has been generated previously
  */
-static int its_already_seen(int *its, size_t itslen,
-		const struct itstree_node *itst)
+static int its_already_seen(const struct fptree *fp, const int *its,
+		size_t itslen, const struct itstree_node *itst)
 {
 	int *cf = calloc(itslen, sizeof(cf[0]));
-	size_t i, ret = 0;
+	size_t ret;
 
-	for (i = 0; i < itslen; i++)
-		cf[i] = its[i];
 
-	qsort(cf, itslen, sizeof(cf[0]), int_cmp);
+	ranks_to_items(fp, its, itslen, cf);
 	ret = search_its_private(itst, cf, itslen);
 
 	free(cf);
@@ -149,83 +186,82 @@ static int its_already_seen(int *its, size_t itslen,
 /**
  * Updates the list of itemsets that were generated.
  */
-static void update_seen_its(const int *its, size_t itslen,
-		size_t n30, size_t n50, size_t n70,
+static void update_seen_its(const struct fptree *fp, const int *its,
+		size_t itslen, size_t n30, size_t n50, size_t n70,
 		struct itstree_node *itst)
 {
 	int *cf = calloc(itslen, sizeof(cf[0]));
-	size_t i;
-
-	for (i = 0; i < itslen; i++)
-		cf[i] = its[i];
 
-	qsort(cf, itslen, sizeof(cf[0]), int_cmp);
+	ranks_to_items(fp, its, itslen, cf);
 	record_its_private(itst, cf, itslen, n30, n50, n70);
 	free(cf);
 }
 
-static void generate_rules_from_itemset(const int *AB, size_t ab_length,
-		const struct fptree *fp, double *minc, double *maxc,
-		size_t *n30, size_t *n50, size_t *n70,
-		struct histogram *h)
+/**
+ * Record the rules from the subset ab of the sorted ranks of a leaf, as
+ * bits of them, with the supports of all the subsets of the leaf in sups,
+ * and the itemset with its counts.
+ */
+static void register_rules(const int *leaf, size_t len, size_t ab,
+		const int *sups, const struct fptree *fp, double *minc,
+		double *maxc, struct histogram *h, struct itstree_node *itst)
 {
-	int *A = calloc(ab_length, sizeof(A[0]));
-	size_t i, j, max, a_length;
-	int sup_ab, sup_a;
-	double c;
+	size_t i, a, n, ab_length = 0, n30 = 0, n50 = 0, n70 = 0;
+	int AB[sizeof(size_t) * 8];
+	double *cs;
+#if PRINT_FINAL_RULES
+	size_t j, a_length;
+	int A[sizeof(size_t) * 8];
+#endif
 
-	max = (1 << ab_length) - 1;
-	sup_ab = fpt_itemset_count(fp, AB, ab_length);
-	for (i = 1; i < max; i++) {
-		a_length = 0;
-		for (j = 0; j < ab_length; j++)
-			if (i & (1 << j))
-				A[a_length++] = AB[j];
+	for (i = 0; i < len; i++)
+		if (ab & ((size_t)1 << i))
+			AB[ab_length++] = leaf[i];
+	cs = calloc((size_t)1 << ab_length, sizeof(cs[0]));
 
-		sup_a = fpt_itemset_count(fp, A, a_length);
-		c = div_or_zero(sup_ab, sup_a);
-		if (c < *minc) *minc = c;
-		if (c > *maxc) *maxc = c;
-		histogram_register(h, c);
-		if (c > .3) *n30+=1;
-		if (c > .5) *n50+=1;
-		if (c > .7) *n70+=1;
+	/* the antecedents are the proper subsets of ab, increasing */
+	for (a = -ab & ab, n = 0; a != ab; a = (a - ab) & ab)
+		cs[n++] = div_or_zero(sups[ab], sups[a]);
 
-#if PRINT_FINAL_RULES
-		print_this_rule(A, AB, a_length, ab_length, c);
-#endif
+	for (i = 0; i < n; i++) {
+		if (cs[i] < *minc) *minc = cs[i];
+		if (cs[i] > *maxc) *maxc = cs[i];
+		histogram_register(h, cs[i]);
+	}
+	for (i = 0; i < n; i++) {
+		n30 += cs[i] > .3;
+		n50 += cs[i] > .5;
+		n70 += cs[i] > .7;
 	}
 
-	free(A);
+#if PRINT_FINAL_RULES
+	for (a = -ab & ab, i = 0; a != ab; a = (a - ab) & ab, i++) {
+		for (j = 0, a_length = 0; j < len; j++)
+			if (a & ((size_t)1 << j))
+				A[a_length++] = leaf[j];
+		print_this_rule(fp, A, AB, a_length, ab_length, cs[i]);
+	}
+#endif
+	update_seen_its(fp, AB, ab_length, n30, n50, n70, itst);
+	free(cs);
 }
 
-static void generate_rules(const int *items, size_t lmax,
-		const struct fptree *fp,
-		double *minc, double *maxc, struct histogram *h,
-		struct itstree_node *itst)
+/* insertion sort of the few ranks of an itemset */
+static void sort_ranks(int *rs, size_t n)
 {
-	size_t i, j, max=1<<lmax, ab_length, n30, n50, n70;
-	int *AB = calloc(lmax, sizeof(AB[0]));
+	size_t i, j;
+	int x;
 
-	for (i = 0; i < max; i++) {
-		ab_length = 0;
-		for (j = 0; j < lmax; j++)
-			if (i & (1 << j))
-				AB[ab_length++] = items[j];
-		if (ab_length < 2)
-			continue;
-		if (its_already_seen(AB, ab_length, itst))
-			continue;
-		n30 = n50 = n70 = 0;
-		generate_rules_from_itemset(AB, ab_length, fp, minc, maxc,
-				&n30, &n50, &n70, h);
-		update_seen_its(AB, ab_length, n30, n50, n70, itst);
+	for (i = 1; i < n; i++) {
+		x = rs[i];
+		for (j = i; j > 0 && rs[j - 1] > x; j--)
+			rs[j] = rs[j - 1];
+		rs[j] = x;
 	}
-
-	free(AB);
 }
 
 struct reservoir_item {
+	/* ranks, in the order they were selected */
 	int *items;
 	size_t sz;
 	int support;
@@ -278,36 +314,48 @@ static inline double quality_d(int x, int y, double c0)
 static inline double compute_d_quality(const struct fptree *fp,
 		double c0, int sup_ab, struct reservoir_item *rit)
 {
-	double bq = quality_d(fpt_item_count(fp, rit->items[rit->sz - 1]),
+	double bq = quality_d(fpt_rank_count(fp, rit->items[rit->sz - 1]),
 			sup_ab, c0);
 #if !EM_LAST_ITEM
 	size_t i, ep = rit->sz - 1;
 
 	for (i = 0; i < ep; i++)
 		bq = EM_REDFUN(bq,
-			quality_d(fpt_item_count(fp, rit->items[i]),
+			quality_d(fpt_rank_count(fp, rit->items[i]),
 				sup_ab, c0));
 #endif
 
 	return bq;
 }
 
+/**
+ * sup_a is the support of all but the last item of rit, the same for all
+ * the candidates of a node, tmp has room for rit->sz ranks.
+ */
 static inline double compute_delta_quality(const struct fptree *fp,
-		int sup_ab, struct reservoir_item *rit)
+		int sup_ab, struct reservoir_item *rit, int sup_a, int *tmp)
 {
-	double bq = sup_ab - fpt_itemset_count(fp, rit->items, rit->sz - 1);
+	double bq = sup_ab - sup_a;
+	/* used only if !EM_LAST_ITEM */
+	(void)fp;
+	(void)rit;
+	(void)tmp;
 
 #if !EM_LAST_ITEM
-	size_t i, j, ep = rit->sz - 1;
+	size_t i, j, k, ep = rit->sz - 1;
 	int t;
 
 	for (i = 0; i < rit->sz; i++) {
 		t = rit->items[ep];
 		rit->items[ep] = rit->items[i];
 		rit->items[i] = t;
-		for (j = 1; j < ep; j++)
-			bq = EM_REDFUN(bq, sup_ab - fpt_itemset_count(fp,
-						rit->items, j));
+		for (j = 1; j < ep; j++) {
+			for (k = 0; k < j; k++)
+				tmp[k] = rit->items[k];
+			sort_ranks(tmp, j);
+			bq = EM_REDFUN(bq, sup_ab - fpt_rankset_count(fp,
+						tmp, j));
+		}
 		t = rit->items[ep];
 		rit->items[ep] = rit->items[i];
 		rit->items[i] = t;
@@ -319,9 +367,10 @@ static inline double compute_delta_quality(const struct fptree *fp,
 
 static inline double compute_quality(const struct fptree *fp, double c0,
 		const struct item_count *ic, size_t ix_item,
-		struct reservoir_item *rit, size_t lmax)
+		struct reservoir_item *rit, int sup_a, int *tmp,
+		size_t lmax)
 {
-	int sup_ab = fpt_itemset_count(fp, rit->items, rit->sz);
+	int sup_ab = rit->support;
 	(void)lmax; /* used only if EM_FORCED_LAST */
 
 	/* select first item: use either real or noisy count */
@@ -339,7 +388,7 @@ static inline double compute_quality(const struct fptree *fp, double c0,
 
 	switch(QMETHOD) {
 	case EM_QD: return compute_d_quality(fp, c0, sup_ab, rit);
-	case EM_QDELTA: return compute_delta_quality(fp, sup_ab, rit);
+	case EM_QDELTA: return compute_delta_quality(fp, sup_ab, rit, sup_a, tmp);
 	default: return sup_ab;
 	}
 }
@@ -354,55 +403,577 @@ static inline int generated_above(const int *celms, size_t level)
 	return 0;
 }
 
-static void mine_level(const struct fptree *fp, const struct item_count *ic,
-		size_t numits, size_t lmax, const int *celms, size_t level,
-		double c0, double *epss, size_t *spls, struct histogram *h,
-		double *minc, double *maxc, struct itstree_node *itst,
-		struct drand48_data *randbuffer)
+struct task_pool {
+	void (*fun)(void *, size_t);
+	void *arg;
+	size_t n, next;
+};
+
+static void *run_pool(void *arg)
+{
+	struct task_pool *tp = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&tp->next, 1, __ATOMIC_RELAXED)) < tp->n)
+		tp->fun(tp->arg, i);
+	return NULL;
+}
+
+/**
+ * Runs fun(arg, i) for each i < n on up to threads threads, each taking
+ * the next i left when done with the last one.
+ */
+static void run_tasks(size_t n, size_t threads, void (*fun)(void *, size_t),
+		void *arg)
+{
+	struct task_pool tp = { fun, arg, n, 0 };
+	pthread_t *th;
+	size_t i;
+
+	threads = min(threads, n);
+	if (threads <= 1) {
+		run_pool(&tp);
+		return;
+	}
+
+	th = calloc(threads - 1, sizeof(th[0]));
+	for (i = 0; i < threads - 1; i++)
+		if (pthread_create(&th[i], NULL, run_pool, &tp))
+			die("Unable to start thread %lu", i);
+	run_pool(&tp);
+	for (i = 0; i < threads - 1; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+}
+
+/* prefix of a node of the mining tree, shared by its children */
+struct mine_prefix {
+	struct fpt_prefix *p;
+	size_t refs;
+};
+
+/**
+ * A node of the mining tree: the items after the level ones in celms are
+ * sampled there, with the generator of key. The key of a child is derived
+ * from the key of the node and its position in the reservoir, so the
+ * choices do not depend on the order the nodes are processed in.
+ */
+struct mine_node {
+	/* ranks selected above, in the order they were selected */
+	int *celms;
+	size_t level;
+	unsigned long key;
+	/* support of celms, as counted by the parent */
+	int sup;
+	/* prefix of the parent, for counting */
+	struct mine_prefix *up;
+	/**
+	 * candidates: index in ic, uniform of their key, support and quality
+	 * once counted, and whether they were visited for the reservoir
+	 */
+	size_t nc, *cand;
+	double *us;
+	int *sups;
+	double *qs;
+	char *counted, *vis;
+	/* lower bounds of their keys, ord sorting them */
+	double *kb;
+	size_t *ord;
+	/* selected children, of the nodes above the last level */
+	struct mine_node **ch;
+	size_t nch;
+};
+
+/**
+ * Leaf whose rules are counted, its ranks sorted: the supports of all its
+ * subsets, and the subsets whose rules are registered, as bits of them.
+ */
+struct rule_job {
+	int *leaf;
+	size_t len;
+	int *sups;
+	size_t *abs, nab;
+};
+
+struct mine_ctx {
+	const struct fptree *fp;
+	const struct item_count *ic;
+	struct itstree_node *itst;
+	struct histogram *h;
+	double *minc, *maxc, c0;
+	const double *epss;
+	const size_t *spls;
+	size_t numits, lmax, threads;
+	/* candidates of the nodes, and the ones counted */
+	size_t ncand, ncounted;
+	/* nodes processed at once, in depth first order */
+	struct mine_node **batch;
+	/* rules counted at once, in the order they were generated */
+	struct rule_job *jobs;
+	size_t nj;
+};
+
+static void release_prefix(struct mine_prefix *mp)
+{
+	if (!mp || --mp->refs)
+		return;
+	if (mp->p)
+		fpt_prefix_free(mp->p);
+	free(mp);
+}
+
+static void free_node(struct mine_node *nd)
+{
+	release_prefix(nd->up);
+	free(nd->celms);
+	free(nd->cand);
+	free(nd->us);
+	free(nd->sups);
+	free(nd->qs);
+	free(nd->counted);
+	free(nd->vis);
+	free(nd->kb);
+	free(nd->ord);
+	free(nd->ch);
+	free(nd);
+}
+
+/**
+ * Upper bound of the quality of candidate i of ic in nd, before counting:
+ * an itemset is at most as frequent as its subsets.
+ */
+static double quality_bound(const struct mine_ctx *ctx,
+		const struct mine_node *nd, size_t i)
+{
+	if (!nd->level)
+#if EM_1ST_ITEM
+		return ctx->ic[i].real_count;
+#else
+		return ctx->ic[i].noisy_count;
+#endif
+
+#if EM_FORCED_LAST
+	if (nd->level == ctx->lmax - 1)
+		return 0;
+#endif
+
+	switch(QMETHOD) {
+	case EM_QD: return 0;
+	case EM_QDELTA: return 0;
+	default: return min(nd->sup, ctx->ic[i].real_count);
+	}
+}
+
+/**
+ * Count the candidates of nd in ks and score them, with the prefix p of
+ * nd or, if NULL above level 0, on the whole tree.
+ */
+static void count_cands(const struct mine_ctx *ctx, struct mine_node *nd,
+		const struct fpt_prefix *p, const size_t *ks, size_t n)
+{
+	size_t i, j, k, level = nd->level;
+	int *its, *ext, *ms, *tmp, *sets, *lens;
+	struct reservoir_item *rit;
+	const int **rs;
+
+	rit = calloc(1, sizeof(*rit));
+	rit->sz = level + 1;
+	rit->items = calloc(rit->sz, sizeof(rit->items[0]));
+	for (i = 0; i < level; i++)
+		rit->items[i] = nd->celms[i];
+	tmp = calloc(rit->sz, sizeof(tmp[0]));
+	sets = calloc((n + 1) * rit->sz, sizeof(sets[0]));
+	ext = calloc(n + 1, sizeof(ext[0]));
+	ms = calloc(n + 1, sizeof(ms[0]));
+	rs = calloc(n + 1, sizeof(rs[0]));
+	lens = calloc(n + 1, sizeof(lens[0]));
+
+	/* all in one batch */
+	for (j = 0; j < n; j++) {
+		rit->items[level] = ctx->ic[nd->cand[ks[j]]].value;
+		its = sets + j * rit->sz;
+		for (i = 0; i <= level; i++)
+			its[i] = rit->items[i];
+		sort_ranks(its, level + 1);
+		ext[j] = rit->items[level];
+		rs[j] = its;
+		lens[j] = level + 1;
+	}
+	if (p || !level)
+		fpt_prefix_count(ctx->fp, p, ext, n, ms);
+	else
+		fpt_ranksets_count(ctx->fp, rs, lens, n, ms);
+	for (j = 0; j < n; j++)
+		nd->sups[ks[j]] = ms[j];
+
+	for (j = 0; j < n; j++) {
+		k = ks[j];
+		i = nd->cand[k];
+		rit->items[level] = ctx->ic[i].value;
+		rit->support = nd->sups[k];
+		nd->qs[k] = compute_quality(ctx->fp, ctx->c0, ctx->ic, i, rit,
+				nd->sup, tmp, ctx->lmax);
+		nd->counted[k] = 1;
+	}
+
+	free_reservoir_item(rit);
+	free(tmp);
+	free(sets);
+	free(ext);
+	free(ms);
+	free(rs);
+	free(lens);
+}
+
+/**
+ * Visit the candidates of nd in the increasing order of the bounds of their
+ * keys, counting them in batches, until none left can enter the reservoir.
+ * The reservoir of the candidates visited (marked in vis) is the one of all
+ * of them. With seen, the itemsets seen already are left out.
+ */
+static void visit_node(const struct mine_ctx *ctx, struct mine_node *nd,
+		const struct fpt_prefix *p, int seen)
+{
+	size_t i, j, c, e, n, nb = 0, pos = 0, level = nd->level;
+	size_t k = ctx->spls[level], batch = max(k, (size_t)1);
+	double v, *best, eps_round = ctx->epss[level] / k;
+	char *out = calloc(nd->nc + 1, sizeof(out[0]));
+	size_t *ks = calloc(nd->nc + 1, sizeof(ks[0]));
+	int *items = calloc(level + 1, sizeof(items[0]));
+
+	/* keys of the k best candidates visited, increasing */
+	best = calloc(k + 1, sizeof(best[0]));
+	for (i = 0; i < level; i++)
+		items[i] = nd->celms[i];
+	memset(nd->vis, 0, nd->nc * sizeof(nd->vis[0]));
+
+	while (k && pos < nd->nc) {
+		e = min(pos + batch, nd->nc);
+		for (j = pos; nb == k && j < e &&
+				nd->kb[nd->ord[j]] < best[k - 1]; j++);
+		if (nb == k)
+			e = j;
+		if (e == pos)
+			break;
+
+		for (j = pos, n = 0; j < e; j++) {
+			c = nd->ord[j];
+			items[level] = ctx->ic[nd->cand[c]].value;
+			out[c] = seen && its_already_seen(ctx->fp, items,
+					level + 1, ctx->itst);
+			if (!out[c] && !nd->counted[c])
+				ks[n++] = c;
+		}
+		count_cands(ctx, nd, p, ks, n);
+
+		for (j = pos; j < e; j++) {
+			c = nd->ord[j];
+			if (out[c])
+				continue;
+			if (nb == k && nd->kb[c] >= best[k - 1])
+				goto done;
+			nd->vis[c] = 1;
+			v = reservoir_log_key(eps_round * nd->qs[c]/2, nd->us[c]);
+			if (nb == k && v >= best[k - 1])
+				continue;
+			for (i = nb < k ? nb++ : k - 1; i > 0 && best[i - 1] > v;
+					i--)
+				best[i] = best[i - 1];
+			best[i] = v;
+		}
+		pos = e;
+		batch *= 2;
+	}
+
+done:
+	free(best);
+	free(out);
+	free(ks);
+	free(items);
+}
+
+/**
+ * Sample the candidates of nd visited. At the last level they are visited
+ * here, leaving out the itemsets seen already; the ones not counted yet
+ * are counted on the whole tree.
+ */
+static struct reservoir *sample_node(const struct mine_ctx *ctx,
+		struct mine_node *nd)
 {
 	struct reservoir_item *rit = calloc(1, sizeof(*rit));
-	const struct reservoir_item *crit;
-	struct reservoir_iterator *ri;
+	size_t i, k, level = nd->level;
 	struct reservoir *r;
 	double eps_round;
-	size_t i;
 
-	r = init_reservoir(spls[level], print_reservoir_item,
+	if (level == ctx->lmax - 1)
+		visit_node(ctx, nd, NULL, 1);
+
+	r = init_reservoir(ctx->spls[level], print_reservoir_item,
 			clone_reservoir_item, free_reservoir_item);
-	eps_round = epss[level] / spls[level];
+	eps_round = ctx->epss[level] / ctx->spls[level];
 
-	/* init common part of rit */
 	rit->sz = level + 1;
-	rit->items = calloc(rit->sz, sizeof(rit[0]));
+	rit->items = calloc(rit->sz, sizeof(rit->items[0]));
 	for (i = 0; i < level; i++)
-		rit->items[i] = celms[i];
+		rit->items[i] = nd->celms[i];
 
-	/* generate last element */
-	for (i = 0; i < numits; i++) {
-		rit->items[level] = ic[i].value;
-		if (generated_above(rit->items, level))
+	/* in the order of the candidates, as if all of them were added */
+	for (k = 0; k < nd->nc; k++) {
+		if (!nd->vis[k])
 			continue;
-		if (level == lmax - 1 &&
-				its_already_seen(rit->items, lmax, itst))
-			continue;
-
-		rit->support = fpt_itemset_count(fp, rit->items, rit->sz);
-		rit->q = compute_quality(fp, c0, ic, i, rit, lmax);
-		add_to_reservoir_log(r, rit, eps_round * rit->q/2, randbuffer);
+		rit->items[level] = ctx->ic[nd->cand[k]].value;
+		rit->support = nd->sups[k];
+		rit->q = nd->qs[k];
+		add_to_reservoir_log_u(r, rit, eps_round * rit->q/2, nd->us[k]);
 	}
 	free_reservoir_item(rit);
+	return r;
+}
+
+struct key_bound {
+	double kb;
+	size_t k;
+};
+
+static int key_bound_cmp(const void *a, const void *b)
+{
+	const struct key_bound *ka = a, *kb = b;
+	int c = double_cmp(&ka->kb, &kb->kb);
+
+	if (c)
+		return c;
+	return ka->k < kb->k ? -1 : ka->k > kb->k;
+}
+
+/**
+ * Draw the keys of the candidates of node ix of the batch and count the
+ * ones which may be selected. Above the last level, sample them too and
+ * make the selected ones its children.
+ */
+static void count_node(void *arg, size_t ix)
+{
+	const struct mine_ctx *ctx = arg;
+	struct mine_node *nd = ctx->batch[ix], *c;
+	const struct fptree *fp = ctx->fp;
+	const struct reservoir_item *crit;
+	size_t i, k, level = nd->level;
+	struct reservoir_iterator *ri;
+	struct fpt_prefix *p = NULL;
+	struct drand48_data buffer;
+	struct key_bound *kbs;
+	struct mine_prefix *mp;
+	struct reservoir *r;
+	double eps_round;
+	int *its;
+
+	if (level)
+		p = fpt_prefix_new(fp, nd->up->p, nd->celms[level - 1]);
+
+	nd->cand = calloc(ctx->numits, sizeof(nd->cand[0]));
+	its = calloc(level + 1, sizeof(its[0]));
+	for (i = 0; i < level; i++)
+		its[i] = nd->celms[i];
+	for (i = 0; i < ctx->numits; i++) {
+		its[level] = ctx->ic[i].value;
+		if (!generated_above(its, level))
+			nd->cand[nd->nc++] = i;
+	}
 
+	/* a uniform for the key of each candidate, in their order */
+	nd->us = calloc(nd->nc + 1, sizeof(nd->us[0]));
+	nd->sups = calloc(nd->nc + 1, sizeof(nd->sups[0]));
+	nd->qs = calloc(nd->nc + 1, sizeof(nd->qs[0]));
+	nd->kb = calloc(nd->nc + 1, sizeof(nd->kb[0]));
+	nd->ord = calloc(nd->nc + 1, sizeof(nd->ord[0]));
+	nd->counted = calloc(nd->nc + 1, sizeof(nd->counted[0]));
+	nd->vis = calloc(nd->nc + 1, sizeof(nd->vis[0]));
+	kbs = calloc(nd->nc + 1, sizeof(kbs[0]));
+	init_rng_stream(nd->key, &buffer);
+	eps_round = ctx->epss[level] / ctx->spls[level];
+	for (k = 0; k < nd->nc; k++) {
+		drand48_r(&buffer, &nd->us[k]);
+		kbs[k].kb = nd->kb[k] = reservoir_log_key(eps_round *
+				quality_bound(ctx, nd, nd->cand[k])/2, nd->us[k]);
+		kbs[k].k = k;
+	}
+	qsort(kbs, nd->nc, sizeof(kbs[0]), key_bound_cmp);
+	for (k = 0; k < nd->nc; k++)
+		nd->ord[k] = kbs[k].k;
+	free(kbs);
+
+	/**
+	 * the last level is sampled in order, as it skips the seen itemsets:
+	 * its candidates are counted here as if none was seen
+	 */
+	visit_node(ctx, nd, p, 0);
+	if (level == ctx->lmax - 1) {
+		if (p)
+			fpt_prefix_free(p);
+		free(its);
+		return;
+	}
+
+	r = sample_node(ctx, nd);
+	mp = calloc(1, sizeof(*mp));
+	mp->p = p;
+	nd->ch = calloc(ctx->spls[level], sizeof(nd->ch[0]));
 	ri = init_reservoir_iterator(r);
-	/* TODO: generate all subtrees after a level? */
-	if (level == lmax - 1)
-		while ((crit = next_item(ri)))
-			generate_rules(crit->items, lmax, fp, minc, maxc, h,
-					itst);
-	else while ((crit = next_item(ri)))
-		mine_level(fp, ic, numits, lmax, crit->items, level + 1, c0,
-				epss, spls, h, minc, maxc, itst, randbuffer);
+	while ((crit = next_item(ri))) {
+		c = calloc(1, sizeof(*c));
+		c->celms = calloc(level + 1, sizeof(c->celms[0]));
+		for (i = 0; i <= level; i++)
+			c->celms[i] = crit->items[i];
+		c->level = level + 1;
+		c->sup = crit->support;
+		c->key = rng_key(nd->key, nd->nch);
+		c->up = mp;
+		mp->refs++;
+		nd->ch[nd->nch++] = c;
+	}
 	free_reservoir_iterator(ri);
 	free_reservoir(r);
+	free(its);
+	if (!nd->nch) {
+		if (p)
+			fpt_prefix_free(p);
+		free(mp);
+	}
+}
+
+static void count_rules_job(void *arg, size_t i)
+{
+	const struct mine_ctx *ctx = arg;
+	struct rule_job *j = &ctx->jobs[i];
+
+	fpt_lattice_count(ctx->fp, j->leaf, j->len, j->sups);
+}
+
+/* count the queued rules and register them in the order they were queued */
+static void flush_rules(struct mine_ctx *ctx)
+{
+	struct rule_job *j;
+	size_t i, k;
+
+	run_tasks(ctx->nj, ctx->threads, count_rules_job, ctx);
+	for (i = 0; i < ctx->nj; i++) {
+		j = &ctx->jobs[i];
+		for (k = 0; k < j->nab; k++)
+			register_rules(j->leaf, j->len, j->abs[k], j->sups,
+					ctx->fp, ctx->minc, ctx->maxc, ctx->h,
+					ctx->itst);
+		free(j->leaf);
+		free(j->sups);
+		free(j->abs);
+	}
+	ctx->nj = 0;
+}
+
+/**
+ * Queue the rules from the subsets of items not seen yet. They are marked
+ * seen at once, so the next itemsets skip them as if they were counted.
+ */
+static void queue_rules(struct mine_ctx *ctx, const int *items)
+{
+	size_t i, j, lmax = ctx->lmax, max = 1 << lmax, ab_length;
+	int *AB = calloc(lmax, sizeof(AB[0]));
+	struct rule_job *jb = &ctx->jobs[ctx->nj];
+
+	/* subsets of sorted ranks are sorted too */
+	jb->leaf = calloc(lmax, sizeof(jb->leaf[0]));
+	for (j = 0; j < lmax; j++)
+		jb->leaf[j] = items[j];
+	sort_ranks(jb->leaf, lmax);
+	jb->len = lmax;
+
+	jb->abs = calloc(max, sizeof(jb->abs[0]));
+	jb->nab = 0;
+	for (i = 0; i < max; i++) {
+		ab_length = 0;
+		for (j = 0; j < lmax; j++)
+			if (i & (1 << j))
+				AB[ab_length++] = jb->leaf[j];
+		if (ab_length < 2)
+			continue;
+		if (its_already_seen(ctx->fp, AB, ab_length, ctx->itst))
+			continue;
+		update_seen_its(ctx->fp, AB, ab_length, 0, 0, 0, ctx->itst);
+		jb->abs[jb->nab++] = i;
+	}
+	free(AB);
+
+	if (!jb->nab) {
+		free(jb->leaf);
+		free(jb->abs);
+		return;
+	}
+	jb->sups = calloc(max, sizeof(jb->sups[0]));
+	if (++ctx->nj == MINE_JOBS)
+		flush_rules(ctx);
+}
+
+/**
+ * Mine the tree of selections depth first, from the root at level 0. The
+ * nodes are counted in batches, by threads; the leaves are sampled and
+ * their rules registered in depth first order, as the itemsets seen by a
+ * leaf are left out of the next ones.
+ */
+static void mine_tree(struct mine_ctx *ctx, unsigned long key)
+{
+	const struct reservoir_item *crit;
+	struct reservoir_iterator *ri;
+	struct mine_node **st, *nd;
+	size_t i, j, nb, ns, sp;
+	struct reservoir *r;
+	int leaf;
+
+	ctx->batch = calloc(MINE_BATCH, sizeof(ctx->batch[0]));
+	ctx->jobs = calloc(MINE_JOBS, sizeof(ctx->jobs[0]));
+	sp = MINE_BATCH;
+	st = calloc(sp, sizeof(st[0]));
+	st[0] = calloc(1, sizeof(*st[0]));
+	st[0]->key = key;
+	ns = 1;
+
+	while (ns) {
+		/* the top of the stack is next in depth first order */
+		leaf = st[ns - 1]->level == ctx->lmax - 1;
+		for (nb = 0; ns && nb < MINE_BATCH &&
+				(st[ns - 1]->level == ctx->lmax - 1) == leaf; nb++)
+			ctx->batch[nb] = st[--ns];
+		run_tasks(nb, ctx->threads, count_node, ctx);
+
+		for (i = 0; leaf && i < nb; i++) {
+			r = sample_node(ctx, ctx->batch[i]);
+			ri = init_reservoir_iterator(r);
+			while ((crit = next_item(ri)))
+				queue_rules(ctx, crit->items);
+			free_reservoir_iterator(ri);
+			free_reservoir(r);
+		}
+
+		/* children of the first node of the batch on top */
+		for (i = nb; !leaf && i-- > 0; ) {
+			nd = ctx->batch[i];
+			if (ns + nd->nch > sp) {
+				sp = 2 * (ns + nd->nch);
+				st = realloc(st, sp * sizeof(st[0]));
+			}
+			for (j = nd->nch; j-- > 0; )
+				st[ns++] = nd->ch[j];
+		}
+		for (i = 0; i < nb; i++) {
+			nd = ctx->batch[i];
+			ctx->ncand += nd->nc;
+			for (j = 0; j < nd->nc; j++)
+				ctx->ncounted += nd->counted[j];
+			free_node(nd);
+		}
+	}
+	flush_rules(ctx);
+
+	free(st);
+	free(ctx->batch);
+	free(ctx->jobs);
 }
 
 static void print_mining_scenario()
@@ -444,12 +1015,14 @@ static void mine_rules(const struct fptree *fp, const struct item_count *ic,
 		struct itstree_node *itst, double eps, double c0,
 		size_t numits, size_t lmax, size_t cspl,
 		struct histogram *h, double *minc, double *maxc,
-		struct drand48_data *randbuffer)
+		struct drand48_data *randbuffer, size_t threads)
 {
+	struct mine_ctx ctx = { 0 };
 	double *epsilons = calloc(lmax, sizeof(epsilons[0]));
 	size_t *spl = calloc(lmax, sizeof(spl[0]));
 	size_t i, f = 1;
 	double cf = 0;
+	long key;
 
 	printf("Mining with eps %lf, numitems=%lu\n", eps, numits);
 	print_mining_scenario();
@@ -470,13 +1043,51 @@ static void mine_rules(const struct fptree *fp, const struct item_count *ic,
 #endif
 	printf("Total leaves %lu\n", f);
 
-	mine_level(fp, ic, numits, lmax, NULL, 0, c0, epsilons, spl, h,
-			minc, maxc, itst, randbuffer);
+	ctx.fp = fp;
+	ctx.ic = ic;
+	ctx.itst = itst;
+	ctx.h = h;
+	ctx.minc = minc;
+	ctx.maxc = maxc;
+	ctx.c0 = c0;
+	ctx.epss = epsilons;
+	ctx.spls = spl;
+	ctx.numits = numits;
+	ctx.lmax = lmax;
+	/* the parts of a partitioned tree are loaded by one thread only */
+	ctx.threads = fp->parts ? 1 : max(threads, (size_t)1);
+	lrand48_r(randbuffer, &key);
+	mine_tree(&ctx, key);
+
+	printf("Candidates: %lu, counted %lu (%5.2lf%%)\n", ctx.ncand,
+			ctx.ncounted, 100 * div_or_zero(ctx.ncounted, ctx.ncand));
 
 	free(epsilons);
 	free(spl);
 }
 
+/**
+ * Effect of the sampling on the counts the rules are mined from: relative
+ * standard errors of the least count of the items mined from the sampling
+ * and from the noise of step 1.
+ */
+static void print_sampling(const struct fptree *fp,
+		const struct item_count *ic, size_t numits, double eps1)
+{
+	int c = 0;
+	size_t i;
+
+	if (fp->q == 1 || !numits)
+		return;
+	for (i = 0; i < numits; i++)
+		if (!i || ic[i].real_count < c)
+			c = ic[i].real_count;
+	printf("Sampling: q=%6.4lf, least count %d (%.0lf in input), error %5.2lf%% sampling, %5.2lf%% noise\n",
+			fp->q, c, c / fp->q,
+			100 * div_or_zero(sqrt(c * (1 - fp->q)), c),
+			100 * div_or_zero(M_SQRT2 / eps1, c));
+}
+
 static void print_recall(const struct itstree_node *itst,
 		const struct histogram *h, size_t numits, size_t lmax)
 {
@@ -521,31 +1132,86 @@ static void print_recall(const struct itstree_node *itst,
 	printf("estRcll: %14.2lf %14.2lf %14.2lf\n", r30, r50, r70);
 }
 
-void dp2d(const struct fptree *fp, struct itstree_node *itst,
+struct dp2d_items {
+	/* items sorted by noisy count */
+	struct item_count *ic;
+	/* generator, continued by the mining step */
+	struct drand48_data randbuffer;
+};
+
+struct dp2d_items *dp2d_rank_items(const struct fptree *fp,
+		double eps, double eps_ratio1, long int seed)
+{
+	struct dp2d_items *di = calloc(1, sizeof(*di));
+
+	di->ic = calloc(fp->n + 1, sizeof(di->ic[0]));
+	init_rng(seed, &di->randbuffer);
+	build_items_table(fp, di->ic, sample_eps(fp, eps) * eps_ratio1,
+			&di->randbuffer);
+	return di;
+}
+
+size_t dp2d_top_items(const struct fptree *fp, const struct dp2d_items *di,
+		size_t ni, int *items)
+{
+	size_t i, n = min(ni, fp->n);
+
+	for (i = 0; i < n; i++)
+		items[i] = fpt_rank_item(fp, di->ic[i].value);
+	return n;
+}
+
+void dp2d_free_items(struct dp2d_items *di)
+{
+	free(di->ic);
+	free(di);
+}
+
+/* a reservoir of cspl items of len ranks */
+static size_t level_reservoir_bytes(size_t len, size_t cspl)
+{
+	return reservoir_bytes(cspl) + cspl *
+		(sizeof(struct reservoir_item) + len * sizeof(int));
+}
+
+size_t dp2d_reservoir_bytes(size_t lmax, size_t cspl, size_t threads)
+{
+	size_t ret = level_reservoir_bytes(lmax, cspl);
+
+	if (lmax > 1)
+		ret += threads * level_reservoir_bytes(lmax - 1, cspl);
+	return ret;
+}
+
+void dp2d(const struct fptree *fp, struct dp2d_items *di,
+		struct itstree_node *itst,
 		double eps, double eps_ratio1, double c0, size_t lmax,
-		size_t ni, size_t cspl, long int seed)
+		size_t ni, size_t cspl, long int seed, size_t threads)
 {
-	struct item_count *ic = calloc(fp->n, sizeof(ic[0]));
-	double epsilon_step1 = eps * eps_ratio1;
+	double epsilon_step1 = sample_eps(fp, eps) * eps_ratio1;
 	struct histogram *h = init_histogram();
 	struct timeval starttime, endtime;
-	struct drand48_data randbuffer;
 	double minc, maxc, t1, t2;
+	int own = !di;
 	size_t numits;
 
 	printf("eps=%lf, eps_step1=%lf, c0=%5.2lf, rmax=%lu\n",
 			eps, epsilon_step1, c0, lmax);
+	/* the counts are not scaled, the noise is calibrated on the sample */
+	if (fp->q < 1)
+		printf("Sampled with q=%6.4lf: eps=%lf on the sample, supports and noise in counts of the sample (divide by q for the input)\n",
+				fp->q, sample_eps(fp, eps));
 
-	init_rng(seed, &randbuffer);
-	build_items_table(fp, ic, epsilon_step1, &randbuffer);
+	if (own)
+		di = dp2d_rank_items(fp, eps, eps_ratio1, seed);
 	minc = 1;
 	maxc = 0;
 	numits = min(ni, fp->n);
-	eps = eps - epsilon_step1;
+	eps = sample_eps(fp, eps) - epsilon_step1;
 
 	gettimeofday(&starttime, NULL);
-	mine_rules(fp, ic, itst, eps, c0, numits, lmax, cspl, h, &minc, &maxc,
-			&randbuffer);
+	mine_rules(fp, di->ic, itst, eps, c0, numits, lmax, cspl, h, &minc,
+			&maxc, &di->randbuffer, threads);
 	gettimeofday(&endtime, NULL);
 	t1 = starttime.tv_sec + (0.0 + starttime.tv_usec) / MICROSECONDS;
 	t2 = endtime.tv_sec + (0.0 + endtime.tv_usec) / MICROSECONDS;
@@ -559,8 +1225,10 @@ void dp2d(const struct fptree *fp, struct itstree_node *itst,
 	printf("Final histogram:\n");
 	histogram_dump(stdout, h, 1, "\t");
 
+	print_sampling(fp, di->ic, numits, epsilon_step1);
 	print_recall(itst, h, numits, lmax);
 
 	free_histogram(h);
-	free(ic);
+	if (own)
+		dp2d_free_items(di);
 }
@@ -4,11 +4,43 @@
 #ifndef _DP2D_H
 #define _DP2D_H
 
+struct dp2d_items;
 struct fptree;
 struct itstree_node;
 
-void dp2d(const struct fptree *fp, struct itstree_node *itst,
+/**
+ * Step 1 of mining: rank the items by their noisy counts, using
+ * eps * eps_ratio1 of the privacy budget.
+ */
+struct dp2d_items *dp2d_rank_items(const struct fptree *fp,
+		double eps, double eps_ratio1, long int seed);
+
+/**
+ * Store in items the first min(ni, fp->n) items of the noisy ranking and
+ * return their number. As the ranking is private this does not use more
+ * of the budget, so the tree can be projected on these items.
+ */
+size_t dp2d_top_items(const struct fptree *fp, const struct dp2d_items *di,
+		size_t ni, int *items);
+
+void dp2d_free_items(struct dp2d_items *di);
+
+/**
+ * Heap used by the reservoirs when mining rules of up to lmax items with
+ * cspl samples per level on threads threads, at most: one reservoir for
+ * each thread above the last level, and one for the last level.
+ */
+size_t dp2d_reservoir_bytes(size_t lmax, size_t cspl, size_t threads);
+
+/**
+ * Mine the rules. If di is NULL the items are ranked here, otherwise the
+ * ranking (and the state of its generator) from dp2d_rank_items is used.
+ * The supports are counted by up to threads threads (one for a partitioned
+ * tree); the rules mined do not depend on their number.
+ */
+void dp2d(const struct fptree *fp, struct dp2d_items *di,
+		struct itstree_node *itst,
 		double eps, double eps_ratio1, double c0, size_t lmax,
-		size_t ni, size_t cspl, long int seed);
+		size_t ni, size_t cspl, long int seed, size_t threads);
 
 #endif
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dp2d.h"
 #include "fp.h"
@@ -30,14 +31,88 @@ static struct {
 	size_t cspl;
 	/* random seed */
 	long int seed;
+	/* options for building the fp-tree */
+	struct fpt_options fpo;
+	/* print the shape and memory of the structures once done */
+	int profile;
+	/* noisy item ranking, if computed while building the fp-tree */
+	struct dp2d_items *di;
 } args;
 
 static void usage(const char *prg)
 {
-	fprintf(stderr, "Usage: %s TFILE IFILE EPS EPS_RATIO_1 C0 RLEN NI BF [SEED]\n", prg);
+	fprintf(stderr, "Usage: %s [-j THREADS] [-p] [-b tree|bitmap] [-m PAIRS] [-c DIR [-V]] [-o DIR [-M MB]] [-s Q] [-P] TFILE IFILE EPS EPS_RATIO_1 C0 RLEN NI BF [SEED]\n", prg);
 	exit(EXIT_FAILURE);
 }
 
+/* rank the items first and keep in the fp-tree only the ones mined */
+static size_t select_top_items(const struct fptree *fp, int *keep, void *arg)
+{
+	(void)arg;
+	args.di = dp2d_rank_items(fp, args.eps, args.er1, args.seed);
+	return dp2d_top_items(fp, args.di, args.ni, keep);
+}
+
+static void parse_options(int *argc, char ***argv)
+{
+	char *prg = (*argv)[0];
+	int opt;
+
+	args.fpo.threads = 1;
+	while ((opt = getopt(*argc, *argv, "j:pb:m:c:Vo:M:s:P")) != -1)
+		switch (opt) {
+		case 'j':
+			if (sscanf(optarg, "%lu", &args.fpo.threads) != 1 ||
+					!args.fpo.threads)
+				usage(prg);
+			break;
+		case 'p':
+			args.fpo.select = select_top_items;
+			break;
+		case 'b':
+			if (!strcmp(optarg, "tree"))
+				args.fpo.backend = FPT_TREE;
+			else if (!strcmp(optarg, "bitmap"))
+				args.fpo.backend = FPT_BITMAP;
+			else
+				usage(prg);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%lu", &args.fpo.pairs) != 1)
+				usage(prg);
+			break;
+		case 'c':
+			args.fpo.image_dir = optarg;
+			break;
+		case 'V':
+			args.fpo.image_verify = 1;
+			break;
+		case 'o':
+			args.fpo.part_dir = optarg;
+			break;
+		case 'M':
+			if (sscanf(optarg, "%lu", &args.fpo.part_mb) != 1)
+				usage(prg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%lf", &args.fpo.sample) != 1 ||
+					args.fpo.sample <= 0 ||
+					args.fpo.sample > 1)
+				usage(prg);
+			break;
+		case 'P':
+			args.profile = 1;
+			break;
+		default:
+			usage(prg);
+		}
+
+	/* leave only the positional arguments, after the program name */
+	*argc -= optind - 1;
+	*argv += optind - 1;
+	(*argv)[0] = prg;
+}
+
 static void parse_arguments(int argc, char **argv)
 {
 	int i;
@@ -47,6 +122,8 @@ static void parse_arguments(int argc, char **argv)
 		printf("%s ", argv[i]);
 	printf("\n");
 
+	parse_options(&argc, &argv);
+
 	if (argc < 9 || argc > 10)
 		usage(argv[0]);
 	args.tfname = strdup(argv[1]);
@@ -68,6 +145,20 @@ static void parse_arguments(int argc, char **argv)
 			usage(argv[0]);
 	} else
 		args.seed = 42;
+	args.fpo.sample_seed = args.seed;
+}
+
+static void print_profile(const struct fptree *fp,
+		const struct itstree_node *itst)
+{
+	size_t tree = fpt_profile(fp, args.ni);
+	size_t its = itstree_bytes(itst);
+	size_t rs = dp2d_reservoir_bytes(args.lmax, args.cspl,
+			args.fpo.threads);
+
+	printf("Heap: fp-tree %.1lf MiB, recall tree %.1lf MiB, reservoirs %.1lf MiB, total %.1lf MiB\n",
+			tree / 1048576.0, its / 1048576.0, rs / 1048576.0,
+			(tree + its + rs) / 1048576.0);
 }
 
 int main(int argc, char **argv)
@@ -77,7 +168,7 @@ int main(int argc, char **argv)
 
 	parse_arguments(argc, argv);
 
-	fpt_read_from_file(args.tfname, &fp);
+	fpt_read_from_file(args.tfname, &fp, &args.fpo);
 	printf("fp-tree: items: %lu, transactions: %lu, nodes: %d, depth: %d\n",
 			fp.n, fp.t, fpt_nodes(&fp), fpt_height(&fp));
 
@@ -85,10 +176,14 @@ int main(int argc, char **argv)
 		itst = init_empty_itstree();
 	else
 		itst = load_its(args.rfname, args.lmax, args.ni);
-	dp2d(&fp, itst, args.eps, args.er1, args.c0, args.lmax,
-			args.ni, args.cspl, args.seed);
+	dp2d(&fp, args.di, itst, args.eps, args.er1, args.c0, args.lmax,
+			args.ni, args.cspl, args.seed, args.fpo.threads);
 
+	if (args.profile)
+		print_profile(&fp, itst);
 	free_itstree(itst);
+	if (args.di)
+		dp2d_free_items(args.di);
 	fpt_cleanup(&fp);
 	free(args.tfname);
 	free(args.rfname);
@@ -1,40 +1,187 @@
-#include <ctype.h>
+#include <fcntl.h>
 #include <gmp.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "fp.h"
 #include "globals.h"
+#include "zinput.h"
 
+/**
+ * Nodes of a tree being built live in one arena and link to each other by
+ * their index in it. The root is node 0, so index 0 in a link also stands
+ * for no node.
+ */
 struct fptree_node {
 	/* item value */
 	int val;
 	/* count of item on this path */
 	int cnt;
-	/* next node in item-chain in tree */
-	struct fptree_node *next;
-	/* number of children nodes */
-	int num_children;
-	/* vector of children nodes */
-	struct fptree_node **children;
-	/* size of said vector */
-	int sz_children;
-	/* parent in tree */
-	struct fptree_node *parent;
+	/* parent, first child and next sibling in tree */
+	uint32_t parent;
+	uint32_t child;
+	uint32_t sibling;
 };
 
+/* a growing array of nodes, a tree being built */
+struct arena {
+	struct fptree_node *nodes;
+	/* nodes used and allocated */
+	uint32_t n, sz;
+};
+
+/* number of top ranked items tracked exactly by the ancestor bitsets */
+#define ANC_BITS 64
+
+/**
+ * The tree once built, read only. Nodes are in DFS order (the root first)
+ * as a structure of arrays and the item-chains are contiguous runs of
+ * node indices, each chain in DFS order.
+ */
+struct fpt_snapshot {
+	/* number of nodes, including the root */
+	uint32_t nn;
+	/* rank of the item (-1 for the root), count, parent and depth */
+	int *rank;
+	int *cnt;
+	uint32_t *parent;
+	uint32_t *depth;
+	/* the chain of rank r is chain[cstart[r]] .. chain[cstart[r+1]-1] */
+	uint32_t *cstart;
+	uint32_t *chain;
+	/* ranks below ANC_BITS on the path from the root to each node */
+	uint64_t *anc;
+	/* skew-binary jump pointer of each node, to one of its ancestors */
+	uint32_t *jump;
+	/* the subtree of node x is x .. end[x]-1, in DFS order */
+	uint32_t *end;
+	/* number of levels, counting the root */
+	int height;
+	/**
+	 * The last added nodes come from fpt_refresh, each after its parent
+	 * but out of DFS order, so end does not cover them. The arrays of the
+	 * nodes have room for cap of them.
+	 */
+	uint32_t added;
+	uint32_t cap;
+	/* tree image the arrays are mapped from, if not NULL */
+	void *map;
+	size_t mapsz;
+};
+
+/* nodes per item chain for each word of a bitmap row to prefer bitmaps */
+#ifndef BITMAP_RATIO
+#define BITMAP_RATIO 4
+#endif
+
+/* largest bitmaps picked automatically, in MiB */
+#ifndef BITMAP_MAX_MB
+#define BITMAP_MAX_MB 1024
+#endif
+
+/* most nodes a prefix is projected on, 8 bytes each */
+#ifndef PREFIX_MAX_NODES
+#define PREFIX_MAX_NODES (1 << 20)
+#endif
+
+/**
+ * Vertical bitmaps: bit t of a row is set if transaction t has the item.
+ * Transactions are numbered in DFS order of the node they end in, so each
+ * node covers a contiguous range of them and the rows are runs of bits.
+ */
+struct fpt_bitmaps {
+	/* words per row */
+	size_t nw;
+	/* row of each rank, -1 for items not in the tree */
+	int *row;
+	uint64_t *bits;
+	/* first and past the last non zero word of each row */
+	size_t *lo, *hi;
+	/* bits set in each row */
+	int *cnt;
+	size_t nr;
+	/**
+	 * With updates, rows have spare bits for the transactions added: the
+	 * first nb bits are used, nb0 of them when built. The transactions
+	 * ending in node x when built are the left[x] bits from home[x], the
+	 * ones added after are the bit more[x] - 1 and the ones linked from
+	 * it by link[bit - nb0], ended by 0. A removed transaction leaves a
+	 * bit clear in every row. Node arrays have room for nn nodes.
+	 */
+	size_t nb, nb0;
+	size_t *home, *more, *link;
+	int *left;
+	uint32_t nn;
+};
+
+/* largest pair matrix, with the partial ones of the threads, in MiB */
+#ifndef PAIRS_MAX_MB
+#define PAIRS_MAX_MB 256
+#endif
+
+/**
+ * Counts of the pairs of the n most frequent items, as the lower triangle
+ * of a matrix: indices i <= j at m[j*(j+1)/2 + i], the diagonal holding
+ * the counts of the items alone.
+ */
+struct fpt_pairs {
+	size_t n;
+	/* index of each rank in the matrix, -1 if not in it */
+	int *pix;
+	int *m;
+};
+
+struct fpt_prefix {
+	/* sorted ranks */
+	int *rs;
+	int len;
+	/* with bitmaps, the nz non zero words of the AND of their rows */
+	uint64_t *bits;
+	size_t *word;
+	size_t nz;
+	/**
+	 * With the tree, the no nodes of the last rank whose path holds the
+	 * prefix, in DFS order. NULL if there are more than PREFIX_MAX_NODES,
+	 * or with a partitioned tree.
+	 */
+	uint32_t *occ;
+	size_t no;
+};
+
+/**
+ * Counts by which neighbouring ranks are out of order, as a fraction of
+ * the counts of all the items, to rank the items again.
+ */
+#ifndef FPT_DRIFT
+#define FPT_DRIFT 0.05
+#endif
+
+/**
+ * Fraction of the nodes of the snapshot added or emptied by fpt_refresh,
+ * and of spare transactions in the bitmaps, before they are built again.
+ */
+#ifndef FPT_SLACK
+#define FPT_SLACK 0.125
+#endif
+
 struct table {
 	/* item value */
 	size_t val;
 	/* count of item */
 	size_t cnt;
-	/* pointer to first node in item-chain in tree */
-	struct fptree_node *fst;
-	/* pointer to last node in item-chain in tree */
-	struct fptree_node *lst;
 	/* reverse permutation index */
 	size_t rpi;
+	/* item kept in the tree (or dropped by a projection) */
+	int kept;
 };
 
 /* sort table entries in descending order */
@@ -44,326 +191,3721 @@ static int fptable_cmp(const void *a, const void *b)
 	return tb->cnt - ta->cnt;
 }
 
-#define LINELENGTH 4096
 #define INITIAL_SIZE 100
 
-static void single_item_stat(FILE *f, struct fptree *fp)
+/* transactions buffered in memory after the single pass over the input */
+struct tbuf {
+	/* items of all transactions, one after the other */
+	int *items;
+	size_t nitems, sitems;
+	/* start of each transaction in items, ntr + 1 entries used */
+	size_t *start;
+	size_t ntr, sstart;
+};
+
+static void tbuf_init(struct tbuf *tb)
+{
+	tb->sitems = INITIAL_SIZE;
+	tb->items = calloc(tb->sitems, sizeof(tb->items[0]));
+	tb->sstart = INITIAL_SIZE;
+	tb->start = calloc(tb->sstart, sizeof(tb->start[0]));
+	tb->nitems = tb->ntr = 0;
+}
+
+static void tbuf_free(struct tbuf *tb)
+{
+	free(tb->items);
+	free(tb->start);
+}
+
+static inline void tbuf_add_item(struct tbuf *tb, int x)
 {
-	size_t x, sa = INITIAL_SIZE, *xs, i;
-	char line[LINELENGTH];
+	if (tb->nitems == tb->sitems) {
+		tb->sitems *= 2;
+		tb->items = realloc(tb->items,
+				tb->sitems * sizeof(tb->items[0]));
+	}
+	tb->items[tb->nitems++] = x;
+}
 
-	fp->t = fp->n = 0;
+static inline void tbuf_end_transaction(struct tbuf *tb)
+{
+	if (tb->ntr + 1 == tb->sstart) {
+		tb->sstart *= 2;
+		tb->start = realloc(tb->start,
+				tb->sstart * sizeof(tb->start[0]));
+	}
+	tb->start[++tb->ntr] = tb->nitems;
+}
 
-	while (fgets(line, LINELENGTH, f))
-		if (line[strlen(line) - 1] == '\n')
-			fp->t++;
+/* item ids below this are looked up directly, larger ones are hashed */
+#define DIRECT_IDS (1 << 16)
 
-	fseek(f, 0, SEEK_SET);
-	xs = calloc(sa, sizeof(xs[0]));
+/**
+ * Dictionary from the item ids in the file to local dense ids (from 1).
+ *
+ * Memory scales with the number of distinct items, not with the largest
+ * id, at most DIRECT_IDS entries being reserved for the common case of
+ * small ids.
+ */
+struct dict {
+	/* local id of small item ids, 0 if not seen */
+	int *direct;
+	/* open addressing hash table for the large ones, 0 is an empty key */
+	size_t *keys;
+	int *vals;
+	size_t hsz, hused;
+	/* original id and count of each local id (index 0 unused) */
+	size_t *ids;
+	size_t *cnt;
+	/* transaction each local id was last added to, the current one */
+	size_t *last;
+	size_t cur;
+	size_t n, sn;
+};
 
-	while (fscanf(f, "%lu", &x) == 1) {
-		if ((size_t)x > fp->n)
-			fp->n = x;
-		if (x >= sa) {
-			i = sa;
-			while (x >= sa)
-				sa *= 2;
-			xs = realloc(xs, sa * sizeof(xs[0]));
-			for (; i < sa; i++)
-				xs[i] = 0;
-		}
-		xs[x]++;
+static void dict_init(struct dict *d)
+{
+	d->direct = calloc(DIRECT_IDS, sizeof(d->direct[0]));
+	d->hsz = 128; /* always a power of 2 */
+	d->hused = 0;
+	d->keys = calloc(d->hsz, sizeof(d->keys[0]));
+	d->vals = calloc(d->hsz, sizeof(d->vals[0]));
+	d->sn = INITIAL_SIZE;
+	d->ids = calloc(d->sn, sizeof(d->ids[0]));
+	d->cnt = calloc(d->sn, sizeof(d->cnt[0]));
+	d->last = calloc(d->sn, sizeof(d->last[0]));
+	d->cur = 1;
+	d->n = 0;
+}
+
+static void dict_free(struct dict *d)
+{
+	free(d->direct);
+	free(d->keys);
+	free(d->vals);
+	free(d->ids);
+	free(d->cnt);
+	free(d->last);
+}
+
+static inline size_t hash_id(size_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static void dict_rehash(struct dict *d)
+{
+	size_t i, j, hsz = d->hsz, *keys = d->keys;
+	int *vals = d->vals;
+
+	d->hsz *= 2;
+	d->keys = calloc(d->hsz, sizeof(d->keys[0]));
+	d->vals = calloc(d->hsz, sizeof(d->vals[0]));
+	for (i = 0; i < hsz; i++) {
+		if (!keys[i])
+			continue;
+		j = hash_id(keys[i]) & (d->hsz - 1);
+		while (d->keys[j])
+			j = (j + 1) & (d->hsz - 1);
+		d->keys[j] = keys[i];
+		d->vals[j] = vals[i];
 	}
+	free(keys);
+	free(vals);
+}
 
-	fp->table = calloc(fp->n, sizeof(fp->table[0]));
-	for (i = 0; i < fp->n; i++) {
-		fp->table[i].val = i + 1;
-		fp->table[i].cnt = xs[i + 1];
-		fp->table[i].fst = NULL;
-		fp->table[i].lst = NULL;
-		fp->table[i].rpi = i;
+static int dict_new_id(struct dict *d, size_t x)
+{
+	if (++d->n == d->sn) {
+		d->sn *= 2;
+		d->ids = realloc(d->ids, d->sn * sizeof(d->ids[0]));
+		d->cnt = realloc(d->cnt, d->sn * sizeof(d->cnt[0]));
+		d->last = realloc(d->last, d->sn * sizeof(d->last[0]));
 	}
-	qsort(fp->table, fp->n, sizeof(fp->table[0]), fptable_cmp);
+	d->ids[d->n] = x;
+	d->cnt[d->n] = 0;
+	d->last[d->n] = 0;
+	return d->n;
+}
 
-	for (x = 0; x < fp->n; x++) {
-		i = fp->table[x].val - 1;
-		if (i < fp->n) /* check to be inside table */
-			fp->table[i].rpi = x;
+/**
+ * Count one occurrence of item x in the current transaction, returning its
+ * local id, or 0 if it is in the transaction already: an item repeated on
+ * a line is kept once, so no rank is ever repeated on a path of the tree.
+ */
+static inline int dict_add(struct dict *d, size_t x)
+{
+	size_t j;
+	int l;
+
+	if (x < DIRECT_IDS) {
+		if (!(l = d->direct[x]))
+			l = d->direct[x] = dict_new_id(d, x);
+	} else {
+		j = hash_id(x) & (d->hsz - 1);
+		while (d->keys[j] && d->keys[j] != x)
+			j = (j + 1) & (d->hsz - 1);
+		if (d->keys[j])
+			l = d->vals[j];
+		else {
+			l = d->vals[j] = dict_new_id(d, x);
+			d->keys[j] = x;
+			if (2 * ++d->hused > d->hsz)
+				dict_rehash(d);
+		}
 	}
 
-	free(xs);
-	fseek(f, 0, SEEK_SET);
+	if (d->last[l] == d->cur)
+		return 0;
+	d->last[l] = d->cur;
+	d->cnt[l]++;
+	return l;
 }
 
-static void fpt_add_transaction(const int *t, int c, int sz,
-		struct fptree_node *fpn, struct table *tb);
-static void read_transactions(FILE *f, const struct fptree *fp)
+#undef DIRECT_IDS
+
+static int size_cmp(const void *a, const void *b)
 {
-	int l, i, save = 0, newt, *items, isz = 0, isp = INITIAL_SIZE;
-	char line[LINELENGTH], *p, *q;
+	const size_t *sa = a, *sb = b;
+	return (*sa > *sb) - (*sa < *sb);
+}
 
-	items = calloc(isp, sizeof(items[0]));
+static int uint32_cmp(const void *a, const void *b)
+{
+	const uint32_t *ua = a, *ub = b;
+	return (*ua > *ub) - (*ua < *ub);
+}
 
-	while (fgets(line, LINELENGTH, f)) {
-		l = strlen(line) - 1;
-		newt = line[l] == '\n';
-		p = line;
+/**
+ * Poisson sampling of the transactions: each one is kept if the hash of
+ * its key and of the seed is below thr, so with probability thr / 2^64.
+ * Keys are the offsets of the lines from base in the input, the same
+ * whatever the number of threads, or line numbers for compressed input.
+ */
+struct sampler {
+	uint64_t thr, seed;
+	const char *base;
+	/* lines seen */
+	size_t line;
+};
+
+static void sampler_init(struct sampler *sm, const struct fpt_options *opts,
+		const char *base, uint64_t id)
+{
+	sm->thr = opts->sample > 0 && opts->sample < 1 ?
+		(uint64_t)(opts->sample * 18446744073709551616.0) : 0;
+	sm->seed = hash_id(opts->sample_seed ^ hash_id(id + 1));
+	sm->base = base;
+	sm->line = 0;
+}
+
+static inline int sampler_keep(struct sampler *sm, const char *p)
+{
+	uint64_t k = sm->base ? (uint64_t)(p - sm->base) : sm->line;
+
+	sm->line++;
+	return !sm->thr || hash_id(k * 0x9e3779b97f4a7c15ULL ^ sm->seed) <
+		sm->thr;
+}
 
-		/* reform number split between reads */
-		if (save) {
-			while (isdigit(*p)) {
-				save = save * 10 + (*p - '0');
+/**
+ * Tokenize the buffer [p, end), recording item counts and transactions.
+ *
+ * A transaction is a line terminated by '\n', items are positive integers
+ * separated by any non-digit characters. Items are stored with their local
+ * id from d, once per line. The items of a last line with no
+ * terminating newline are counted but do not form a transaction, same as
+ * with the old fgets based reader. Lines not kept by sm are skipped.
+ */
+static void parse_transactions(const char *p, const char *end,
+		struct tbuf *tb, struct dict *d, struct sampler *sm)
+{
+	const char *eol;
+	size_t x;
+	int l;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		if (!sampler_keep(sm, p)) {
+			p = eol + 1;
+			continue;
+		}
+		while (p < eol) {
+			while (p < eol && (unsigned)(*p - '0') > 9)
 				p++;
-			}
-			if (isz >= isp) {
-				isp *= 2;
-				items = realloc(items, isp * sizeof(items[0]));
-			}
-			items[isz++] = save;
-			save = 0;
+			if (p == eol)
+				break;
+			x = 0;
+			while (p < eol && (unsigned)(*p - '0') <= 9)
+				x = x * 10 + (*p++ - '0');
+			if (!x) /* item 0 ends the line, as strtol did */
+				p = eol;
+			else if ((l = dict_add(d, x)))
+				tbuf_add_item(tb, l);
 		}
+		d->cur++;
 
-		/* see if another number is split */
-		if (isdigit(line[l])) {
-			q = strrchr(line, ' ');
-			if (q) {
-				save = strtol(q, NULL, 0);
-				*q = 0; /* remove last number */
-			}
+		if (eol == end) {
+			tb->nitems = tb->start[tb->ntr];
+			break;
 		}
+		tbuf_end_transaction(tb);
+		p = eol + 1;
+	}
+}
 
-		while ((i = strtol(p, &q, 10))) {
-			if (isz >= isp) {
-				isp *= 2;
-				items = realloc(items, isp * sizeof(items[0]));
-			}
-			items[isz++] = i;
-			p = q;
-		}
+/* the transaction file, mapped in memory */
+struct input {
+	char *data;
+	size_t sz;
+	/* device, inode and modification time (ns) of the file */
+	uint64_t dev, ino, mtime;
+};
 
-		if (newt) {
-			for (i = 0; i < isz; i++)
-				items[i] = fp->table[items[i]-1].rpi;
-			qsort(items, isz, sizeof(items[0]), int_cmp);
-			for (i = 0; i < isz; i++)
-				items[i] = fp->table[items[i]].val;
-			fpt_add_transaction(items, 0, isz, fp->tree, fp->table);
-			isz = 0;
-		}
+static void map_file(const char *fname, struct input *in)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die("Invalid transaction filename %s", fname);
+	if (fstat(fd, &st) < 0)
+		die("Unable to stat %s", fname);
+
+	in->data = NULL;
+	in->sz = st.st_size;
+	in->dev = st.st_dev;
+	in->ino = st.st_ino;
+	in->mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	if (in->sz > 0) {
+		in->data = mmap(NULL, in->sz, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in->data == MAP_FAILED)
+			die("Unable to map %s", fname);
+		madvise(in->data, in->sz, MADV_SEQUENTIAL);
 	}
 
-	free(items);
+	close(fd);
+}
+
+static void unmap_file(const struct input *in)
+{
+	if (in->sz > 0)
+		munmap(in->data, in->sz);
+}
+
+/* rank the items by their counts */
+static void order_table(struct fptree *fp)
+{
+	size_t x, i;
+
+	qsort(fp->table, fp->n, sizeof(fp->table[0]), fptable_cmp);
+	for (x = 0; x < fp->n; x++) {
+		i = fp->table[x].val - 1;
+		if (i < fp->n) /* check to be inside table */
+			fp->table[i].rpi = x;
+	}
+}
+
+/**
+ * Build the header table for the n items, of counts cnt (of item i + 1).
+ */
+static void build_table(const size_t *cnt, size_t n, struct fptree *fp)
+{
+	size_t i;
+
+	fp->n = n;
+	fp->table = calloc(fp->n, sizeof(fp->table[0]));
+	for (i = 0; i < fp->n; i++) {
+		fp->table[i].val = i + 1;
+		fp->table[i].cnt = cnt[i];
+		fp->table[i].rpi = i;
+		fp->table[i].kept = 1;
+	}
+	order_table(fp);
+}
+
+/**
+ * Project the tree on the items chosen by opts->select, if given.
+ */
+static void select_items(struct fptree *fp, const struct fpt_options *opts)
+{
+	size_t i, k;
+	int *keep;
+
+	if (!opts->select)
+		return;
+
+	keep = calloc(fp->n + 1, sizeof(keep[0]));
+	k = opts->select(fp, keep, opts->select_arg);
+	for (i = 0; i < fp->n; i++)
+		fp->table[i].kept = 0;
+	for (i = 0; i < k; i++)
+		if (keep[i] > 0 && (size_t)keep[i] <= fp->n)
+			fp->table[fp->table[keep[i] - 1].rpi].kept = 1;
+	free(keep);
+
+	printf("Projecting fp-tree on %lu of %lu items\n", k, fp->n);
 }
 
-#undef LINELENGTH
 #undef INITIAL_SIZE
-#define INITIAL_SIZE 10
+#define INITIAL_SIZE 1024
 
-static struct fptree_node *fpt_node_new()
+/* start a tree with only the root */
+static void arena_init(struct arena *a)
 {
-	struct fptree_node *ret = calloc(1, sizeof(ret[0]));
-	ret->sz_children = INITIAL_SIZE;
-	ret->children = calloc(ret->sz_children, sizeof(ret->children[0]));
-	return ret;
+	a->sz = INITIAL_SIZE;
+	a->nodes = calloc(a->sz, sizeof(a->nodes[0]));
+	a->n = 1;
 }
 
 #undef INITIAL_SIZE
 
-static void fpt_add_transaction(const int *t, int c, int sz,
-		struct fptree_node *fpn, struct table *tb)
+static uint32_t arena_new(struct arena *a, int val, int cnt)
 {
 	struct fptree_node *n;
-	int i, elem = t[c];
 
-	if (c >= sz)
-		return;
+	if (a->n == a->sz) {
+		if (a->sz > UINT32_MAX / 2)
+			die("Too many nodes in fp-tree");
+		a->sz *= 2;
+		a->nodes = realloc(a->nodes, a->sz * sizeof(a->nodes[0]));
+	}
+	n = &a->nodes[a->n];
+	n->val = val;
+	n->cnt = cnt;
+	n->parent = n->child = n->sibling = 0;
+	return a->n++;
+}
 
-	for (i = 0; i < fpn->num_children; i++)
-		if (fpn->children[i]->val == elem) {
-			fpn->children[i]->cnt++;
-			fpt_add_transaction(t, c + 1, sz, fpn->children[i], tb);
-			return;
-		}
+/**
+ * Add a new child for item val with count w to node p. Children are kept
+ * in no particular order.
+ */
+static uint32_t fpt_node_add_child(struct arena *a, uint32_t p,
+		int val, int w)
+{
+	uint32_t x = arena_new(a, val, w);
+	struct fptree_node *nodes = a->nodes;
+
+	nodes[x].parent = p;
+	nodes[x].sibling = nodes[p].child;
+	nodes[p].child = x;
+	return x;
+}
 
-	if (fpn->num_children == fpn->sz_children) {
-		fpn->sz_children *= 2;
-		fpn->children = realloc(fpn->children, fpn->sz_children * sizeof(fpn->children));
+/**
+ * Children lookup while inserting. Narrow nodes scan their list of
+ * children. Once a scan passes WIDE_NODE children, the node's children are
+ * entered in a hash table keyed by (parent, item). From then on they are
+ * found there, so wide nodes (the root and the first levels on sparse
+ * data) cost O(1) per insert.
+ */
+#ifndef WIDE_NODE
+#define WIDE_NODE 16
+#endif
+
+struct child_index {
+	/* open addressing hash table, 0 is an empty key */
+	size_t *keys;
+	uint32_t *vals;
+	size_t hsz, hused;
+};
+
+/**
+ * What is kept of a tree loaded for updates: the arena it is frozen from,
+ * the index in the snapshot of each of its nodes (0 for none) and the
+ * updates not seen yet by the counts.
+ */
+struct fpt_updates {
+	struct arena a;
+	struct child_index ci;
+	uint32_t *ix;
+	uint32_t nix;
+	/* arena nodes below nix with a new count, the arena nodes after are new */
+	uint32_t *touched;
+	size_t nt, szt;
+	/* nodes of the snapshot emptied by updates */
+	uint32_t dead;
+	/* transactions with none of the items kept, so in no node */
+	size_t empty;
+	/**
+	 * Items loaded, whose ids are in increasing order, and the items
+	 * added after them by updates, by increasing id.
+	 */
+	size_t n0;
+	int *added;
+	/**
+	 * Each update as w, len, the arena node its transaction ends in and
+	 * the ranks of its len items.
+	 */
+	int *log;
+	size_t nlog, szlog;
+	struct fpt_options opts;
+};
+
+/* key of child val of p, item 0 marking p itself as indexed */
+static inline size_t child_key(uint32_t p, int val)
+{
+	return ((size_t)p + 1) << 32 | (uint32_t)val;
+}
+
+static void child_index_init(struct child_index *ci)
+{
+	ci->hsz = 128; /* always a power of 2 */
+	ci->keys = calloc(ci->hsz, sizeof(ci->keys[0]));
+	ci->vals = calloc(ci->hsz, sizeof(ci->vals[0]));
+	ci->hused = 0;
+}
+
+static void child_index_free(struct child_index *ci)
+{
+	free(ci->keys);
+	free(ci->vals);
+}
+
+/* slot of key k, empty if not present */
+static inline size_t child_slot(const struct child_index *ci, size_t k)
+{
+	size_t j = hash_id(k) & (ci->hsz - 1);
+
+	while (ci->keys[j] && ci->keys[j] != k)
+		j = (j + 1) & (ci->hsz - 1);
+	return j;
+}
+
+static void child_index_put(struct child_index *ci, size_t k, uint32_t v)
+{
+	size_t i, j, hsz = ci->hsz, *keys = ci->keys;
+	uint32_t *vals = ci->vals;
+
+	if (2 * (ci->hused + 1) > ci->hsz) {
+		ci->hsz *= 2;
+		ci->keys = calloc(ci->hsz, sizeof(ci->keys[0]));
+		ci->vals = calloc(ci->hsz, sizeof(ci->vals[0]));
+		for (i = 0; i < hsz; i++)
+			if (keys[i]) {
+				j = child_slot(ci, keys[i]);
+				ci->keys[j] = keys[i];
+				ci->vals[j] = vals[i];
+			}
+		free(keys);
+		free(vals);
+	}
+
+	j = child_slot(ci, k);
+	ci->keys[j] = k;
+	ci->vals[j] = v;
+	ci->hused++;
+}
+
+static inline int child_index_has(const struct child_index *ci, size_t k)
+{
+	return ci->keys[child_slot(ci, k)] != 0;
+}
+
+/* child of p for item val, 0 if none */
+static uint32_t child_find(const struct arena *a, struct child_index *ci,
+		uint32_t p, int val)
+{
+	const struct fptree_node *nodes = a->nodes;
+	uint32_t x;
+	size_t j;
+	int k = 0;
+
+	if (child_index_has(ci, child_key(p, 0))) {
+		j = child_slot(ci, child_key(p, val));
+		return ci->keys[j] ? ci->vals[j] : 0;
 	}
-	n = fpt_node_new();
-	n->val = elem;
-	n->cnt = 1;
-	i = tb[elem-1].rpi;
-	if (tb[i].fst == NULL)
-		tb[i].fst = tb[i].lst = n;
-	else {
-		tb[i].lst->next = n;
-		tb[i].lst = n;
+
+	for (x = nodes[p].child; x; x = nodes[x].sibling, k++)
+		if (nodes[x].val == val)
+			return x;
+
+	if (k >= WIDE_NODE) {
+		child_index_put(ci, child_key(p, 0), 1);
+		for (x = nodes[p].child; x; x = nodes[x].sibling)
+			child_index_put(ci, child_key(p, nodes[x].val), x);
 	}
-	fpn->children[fpn->num_children++] = n;
-	n->parent = fpn;
-	fpt_add_transaction(t, c + 1, sz, n, tb);
+	return 0;
 }
 
-static void fpt_node_free(const struct fptree_node *r)
+static uint32_t child_add(struct arena *a, struct child_index *ci,
+		uint32_t p, int val, int w)
 {
-	int i;
+	uint32_t x = fpt_node_add_child(a, p, val, w);
 
-	for (i = 0; i < r->num_children; i++)
-		fpt_node_free(r->children[i]);
-	free(r->children);
-	free((void*)r);
+	if (child_index_has(ci, child_key(p, 0)))
+		child_index_put(ci, child_key(p, val), x);
+	return x;
 }
 
-static int fpt_get_height(const struct fptree_node *r)
+/**
+ * Add transaction t of sz items with multiplicity w to the tree.
+ */
+static void fpt_add_transaction(const int *t, int sz, int w,
+		struct arena *a, struct child_index *ci)
 {
-	int ret = 0, i, x;
+	uint32_t p, x;
+	int i;
 
-	for (i = 0; i < r->num_children; i++) {
-		x = fpt_get_height(r->children[i]);
-		if (ret < x)
-			ret = x;
+	for (i = 0, p = 0; i < sz; i++, p = x) {
+		x = child_find(a, ci, p, t[i]);
+		if (x)
+			a->nodes[x].cnt += w;
+		else
+			x = child_add(a, ci, p, t[i], w);
 	}
+}
 
-	return ret + 1;
+/* a distinct transaction of rank sorted items, in the bulk-load buffer */
+struct trans {
+	const int *items;
+	int len;
+	/* number of times it occurs */
+	int w;
+};
+
+/* lexicographic order of transactions, a prefix before its extensions */
+static int trans_cmp(const void *a, const void *b)
+{
+	const struct trans *ta = a, *tb = b;
+	int i, l = min(ta->len, tb->len);
+
+	for (i = 0; i < l; i++)
+		if (ta->items[i] != tb->items[i])
+			return ta->items[i] - tb->items[i];
+	return ta->len - tb->len;
 }
 
-static int fpt_get_nodes(const struct fptree_node *r)
+static inline int trans_prefix(const struct trans *ta, const struct trans *tb)
 {
-	int ret = 1, i;
+	int i, l = min(ta->len, tb->len);
 
-	for (i = 0; i < r->num_children; i++)
-		ret += fpt_get_nodes(r->children[i]);
+	for (i = 0; i < l && ta->items[i] == tb->items[i]; i++);
+	return i;
+}
 
-	return ret;
+static inline size_t trans_hash(const int *items, int len)
+{
+	size_t h = len;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ items[i]) * 0x100000001b3ULL;
+	return hash_id(h);
 }
 
-static void fpt_node_print(const struct fptree_node *r, int gap)
+/**
+ * Collapse identical transactions of tb into the distinct ones of ts,
+ * returning how many there are.
+ */
+static size_t dedup_transactions(const struct tbuf *tb, struct trans *ts)
 {
-	int i, j;
+	size_t t, j, n = 0, hsz = 1, *ht;
+	const int *items;
+	int len;
+
+	while (hsz < 2 * tb->ntr)
+		hsz *= 2;
+	ht = calloc(hsz, sizeof(ht[0]));
+
+	for (t = 0; t < tb->ntr; t++) {
+		items = tb->items + tb->start[t];
+		len = tb->start[t + 1] - tb->start[t];
+
+		/* ht holds indices in ts plus one, 0 is empty */
+		j = trans_hash(items, len) & (hsz - 1);
+		for (; ht[j]; j = (j + 1) & (hsz - 1))
+			if (ts[ht[j] - 1].len == len && !memcmp(items,
+				ts[ht[j] - 1].items, len * sizeof(items[0])))
+				break;
 
-	if (gap)
-		printf("%*c", 2 * gap, ' ');
-	printf("%p %d %d %p %d <", r, r->val, r->cnt, r->next, r->num_children);
-	for (j = 0; j < r->num_children; j++)
-		printf("%p ", r->children[j]);
-	printf("> %d\n", r->sz_children);
-	for (i = 0; i < r->num_children; i++) {
-		fpt_node_print(r->children[i], gap + 1);
+		if (ht[j])
+			ts[ht[j] - 1].w++;
+		else {
+			ts[n].items = items;
+			ts[n].len = len;
+			ts[n].w = 1;
+			ht[j] = ++n;
+		}
 	}
+
+	free(ht);
+	return n;
 }
 
-void fpt_tree_print(const struct fptree *fp)
+/* sort items in increasing order, short transactions by insertion */
+static inline void sort_items(int *items, int len)
 {
-	fpt_node_print(fp->tree, 0);
+	int i, j, x;
+
+	if (len > 16) {
+		qsort(items, len, sizeof(items[0]), int_cmp);
+		return;
+	}
+
+	for (i = 1; i < len; i++) {
+		x = items[i];
+		for (j = i; j > 0 && items[j - 1] > x; j--)
+			items[j] = items[j - 1];
+		items[j] = x;
+	}
 }
 
-void fpt_table_print(const struct fptree *fp)
+/**
+ * Bulk-load the buffered transactions in the tree under root.
+ *
+ * The transactions are mapped to ranks and identical ones are collapsed
+ * into a single weighted insertion. The distinct ones are then sorted
+ * lexicographically, so each insertion only follows or extends the
+ * rightmost path of the tree: no child is ever searched for and the nodes
+ * are created in depth-first order.
+ */
+static void build_tree(struct tbuf *tb, const int *remap,
+		const struct fptree *fp, struct arena *a)
 {
-	struct table *table = fp->table;
-	struct fptree_node *p;
-	int n = fp->n;
-	int i;
+	struct trans *ts = calloc(tb->ntr + 1, sizeof(ts[0]));
+	int i, l, isz, maxlen = 0, *items;
+	uint32_t *path;
+	size_t t, n, s, e, o;
 
-	for (i = 0; i < n; i++) {
-		printf("%d] %lu %lu %lu | %p -> %p |", i, table[i].val, table[i].cnt, table[i].rpi, table[i].fst, table[i].lst);
-		p = table[i].fst;
-		while (p != table[i].lst) {
-			printf(" %p", p);
-			p = p->next;
+	/* map to ranks, drop items not kept and compact tb in place */
+	for (t = 0, s = 0, o = 0; t < tb->ntr; t++, s = e) {
+		e = tb->start[t + 1];
+		tb->start[t] = o;
+		items = tb->items + o;
+		isz = e - s;
+		for (i = 0, l = 0; i < isz; i++) {
+			items[l] = fp->table[remap[tb->items[s + i]]-1].rpi;
+			if (fp->table[items[l]].kept)
+				l++;
 		}
-		printf(" %p\n", p);
+		sort_items(items, l);
+		maxlen = max(maxlen, l);
+		o += l;
+	}
+	tb->start[tb->ntr] = o;
+	tb->nitems = o;
+	n = dedup_transactions(tb, ts);
+	qsort(ts, n, sizeof(ts[0]), trans_cmp);
+
+	path = calloc(maxlen + 1, sizeof(path[0]));
+	for (t = 0; t < n; t++) {
+		l = t ? trans_prefix(&ts[t - 1], &ts[t]) : 0;
+		for (i = 0; i < l; i++)
+			a->nodes[path[i + 1]].cnt += ts[t].w;
+		for (i = l; i < ts[t].len; i++)
+			path[i + 1] = fpt_node_add_child(a, path[i],
+					fp->table[ts[t].items[i]].val,
+					ts[t].w);
 	}
+
+	free(path);
+	free(ts);
 }
 
-void fpt_read_from_file(const char *fname, struct fptree *fp)
+/* node after the subtree of x in a preorder walk, 0 once back at the root */
+static inline uint32_t fpt_node_skip(const struct fptree_node *nodes,
+		uint32_t x, int *depth)
 {
-	FILE *f = fopen(fname, "r");
+	for (; x && !nodes[x].sibling; x = nodes[x].parent)
+		*depth -= 1;
+	return x ? nodes[x].sibling : 0;
+}
 
-	if (!f)
-		die("Invalid transaction filename %s", fname);
+/**
+ * Node after x in a preorder walk of the tree, 0 once back at the root.
+ * Keeps depth up to date, the root being at depth 0.
+ */
+static inline uint32_t fpt_node_walk(const struct fptree_node *nodes,
+		uint32_t x, int *depth)
+{
+	if (nodes[x].child) {
+		*depth += 1;
+		return nodes[x].child;
+	}
+	return fpt_node_skip(nodes, x, depth);
+}
 
-	printf("Reading file to determine counts of items ... ");
-	fflush(stdout);
-	single_item_stat(f, fp);
-	printf("OK\n");
+static int fpt_get_height(const struct fptree_node *nodes)
+{
+	int ret = 0, d = 0;
+	uint32_t x;
 
-	fp->tree = fpt_node_new();
-	printf("Reading file to build fp-tree ... ");
-	fflush(stdout);
-	read_transactions(f, fp);
-	printf("OK\n");
+	for (x = fpt_node_walk(nodes, 0, &d); x; x = fpt_node_walk(nodes, x, &d))
+		if (ret < d)
+			ret = d;
 
-	fclose(f);
+	return ret + 1;
 }
 
-void fpt_cleanup(const struct fptree *fp)
+/**
+ * Freeze the tree built in a into fp's read only snapshot, leaving out the
+ * nodes whose count dropped to 0 with updates. If not NULL, ix (zeroed,
+ * with a->n entries) gets the index in the snapshot of each arena node.
+ */
+static void fpt_freeze(const struct arena *a, struct fptree *fp, uint32_t *ix)
 {
-	free(fp->table);
-	fpt_node_free(fp->tree);
+	struct fpt_snapshot *s = calloc(1, sizeof(*s));
+	const struct fptree_node *nodes = a->nodes;
+	uint32_t x, y, p, *own = NULL;
+	int d = 0;
+	size_t r;
+
+	s->nn = a->n;
+	s->rank = calloc(s->nn, sizeof(s->rank[0]));
+	s->cnt = calloc(s->nn, sizeof(s->cnt[0]));
+	s->parent = calloc(s->nn, sizeof(s->parent[0]));
+	s->depth = calloc(s->nn, sizeof(s->depth[0]));
+	s->cstart = calloc(fp->n + 1, sizeof(s->cstart[0]));
+	s->chain = calloc(s->nn, sizeof(s->chain[0]));
+	s->anc = calloc(s->nn, sizeof(s->anc[0]));
+	s->jump = calloc(s->nn, sizeof(s->jump[0]));
+	s->end = calloc(s->nn, sizeof(s->end[0]));
+
+	/* DFS index of each arena node, parents are always seen first */
+	if (!ix)
+		ix = own = calloc(s->nn, sizeof(ix[0]));
+	s->rank[0] = -1;
+	s->cnt[0] = nodes[0].cnt;
+	for (x = fpt_node_walk(nodes, 0, &d), y = 1; x;
+			x = fpt_node_walk(nodes, x, &d), y++) {
+		/* emptied by updates, with all its subtree */
+		while (x && !nodes[x].cnt)
+			x = fpt_node_skip(nodes, x, &d);
+		if (!x)
+			break;
+		ix[x] = y;
+		s->rank[y] = fp->table[nodes[x].val - 1].rpi;
+		s->cnt[y] = nodes[x].cnt;
+		s->parent[y] = p = ix[nodes[x].parent];
+		s->depth[y] = d;
+		s->anc[y] = s->anc[p];
+		if (s->rank[y] < ANC_BITS)
+			s->anc[y] |= 1ULL << s->rank[y];
+		/* Myers' jump pointers, O(log depth) steps to any ancestor */
+		if (s->depth[p] - s->depth[s->jump[p]] ==
+				s->depth[s->jump[p]] - s->depth[s->jump[s->jump[p]]])
+			s->jump[y] = s->jump[s->jump[p]];
+		else
+			s->jump[y] = p;
+		s->height = max(s->height, d);
+		s->cstart[s->rank[y] + 1]++;
+	}
+	s->cap = s->nn;
+	s->nn = y;
+	s->height++;
+	free(own);
+
+	/* children come after their parent, so their subtrees end first */
+	for (y = s->nn; y-- > 0; ) {
+		s->end[y] = max(s->end[y], y + 1);
+		if (y)
+			s->end[s->parent[y]] = max(s->end[s->parent[y]],
+					s->end[y]);
+	}
+
+	for (r = 0; r < fp->n; r++)
+		s->cstart[r + 1] += s->cstart[r];
+	for (y = 1; y < s->nn; y++)
+		s->chain[s->cstart[s->rank[y]]++] = y;
+	for (r = fp->n; r > 0; r--)
+		s->cstart[r] = s->cstart[r - 1];
+	s->cstart[0] = 0;
+
+	fp->tree = s;
 }
 
-int fpt_height(const struct fptree *fp)
+void fpt_tree_print(const struct fptree *fp)
 {
-	return fpt_get_height(fp->tree);
+	const struct fpt_snapshot *s = fp->tree;
+	uint32_t x;
+
+	for (x = 0; x < s->nn; x++) {
+		if (s->depth[x])
+			printf("%*c", 2 * s->depth[x], ' ');
+		printf("%u %d %d %u\n", x, s->rank[x], s->cnt[x], s->parent[x]);
+	}
 }
 
-int fpt_nodes(const struct fptree *fp)
+void fpt_table_print(const struct fptree *fp)
 {
-	return fpt_get_nodes(fp->tree);
+	const struct fpt_snapshot *s = fp->tree;
+	struct table *table = fp->table;
+	int n = fp->n;
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		printf("%d] %lu %lu %lu |", i, table[i].val, table[i].cnt, table[i].rpi);
+		for (j = s->cstart[i]; j < s->cstart[i + 1]; j++)
+			printf(" %u", s->chain[j]);
+		printf("\n");
+	}
 }
 
-int fpt_item_count(const struct fptree *fp, int it)
+/* part of the input handled by one thread */
+struct shard {
+	/* chunk of input, ends after a newline (except for the last one) */
+	const char *p, *end;
+	/* or stream of blocks, for compressed input */
+	struct zstream *zs;
+	/* transactions and items in chunk, local to global id translation */
+	struct tbuf tb;
+	struct dict d;
+	int *remap;
+	struct sampler sm;
+	/* private tree */
+	const struct fptree *fp;
+	struct arena tree;
+};
+
+static void split_input(const struct input *in, struct shard *sh, size_t nsh)
 {
-	if (it < 0 || (size_t)it >= fp->n)
-		return 0;
-	return fp->table[fp->table[it].rpi].cnt;
+	const char *p = in->data, *end = in->data + in->sz, *q;
+	size_t i;
+
+	for (i = 0; i < nsh; i++) {
+		sh[i].p = p;
+		if (i == nsh - 1)
+			q = end;
+		else {
+			q = max(p, (const char *)in->data + in->sz / nsh * (i + 1));
+			if (q < end)
+				q = memchr(q, '\n', end - q);
+			q = q && q < end ? q + 1 : end;
+		}
+		sh[i].end = p = q;
+	}
 }
 
-static int search_on_path(const struct fptree_node *n,
-		const int *key, int keylen)
+static void *shard_parse(void *arg)
 {
-	int i = keylen - 2;
-	struct fptree_node *p = n->parent;
+	struct shard *sh = arg;
+	size_t len;
+	char *blk;
 
-	while (p && i >= 0) {
-		/* cut */
-		if (i > 0 && p->val == key[i-1])
-			return 0;
-		/* found */
-		if (p->val == key[i])
-			i--;
-		p = p->parent;
+	if (!sh->zs) {
+		parse_transactions(sh->p, sh->end, &sh->tb, &sh->d, &sh->sm);
+		return NULL;
 	}
 
-	if (!p)
-		return 0;
+	while ((blk = zstream_next(sh->zs, &len))) {
+		parse_transactions(blk, blk + len, &sh->tb, &sh->d, &sh->sm);
+		free(blk);
+	}
+	return NULL;
+}
+
+static void *shard_build(void *arg)
+{
+	struct shard *sh = arg;
 
-	return n->cnt;
+	build_tree(&sh->tb, sh->remap, sh->fp, &sh->tree);
+	return NULL;
 }
 
-int fpt_itemset_count(const struct fptree *fp, const int *its, int itslen)
+struct merge_task {
+	struct arena *dst, *src;
+};
+
+/**
+ * Merge the tree in src into the one in dst, with a preorder walk of src.
+ * path[d] is the node of dst matching the last node seen at depth d.
+ */
+static void fpt_merge(struct arena *dst, const struct arena *src)
 {
-	int *search_key = calloc(itslen, sizeof(search_key[0]));
-	int i, count = 0, key_len = 0;
-	struct fptree_node *p, *l;
+	const struct fptree_node *nodes = src->nodes;
+	uint32_t x, y, *path;
+	struct child_index ci;
+	int d = 0;
 
-	for (i = 0; i < itslen; i++)
-		if (its[i] > 0)
-			search_key[key_len++] = fp->table[its[i] - 1].rpi;
-	qsort(search_key, key_len, sizeof(search_key[0]), int_cmp);
-	for (i = 0; i < key_len; i++)
-		search_key[i] = fp->table[search_key[i]].val;
+	path = calloc(fpt_get_height(nodes) + 1, sizeof(path[0]));
+	child_index_init(&ci);
+	for (x = fpt_node_walk(nodes, 0, &d); x; x = fpt_node_walk(nodes, x, &d)) {
+		y = child_find(dst, &ci, path[d - 1], nodes[x].val);
+		if (y)
+			dst->nodes[y].cnt += nodes[x].cnt;
+		else
+			y = child_add(dst, &ci, path[d - 1], nodes[x].val,
+					nodes[x].cnt);
+		path[d] = y;
+	}
+	child_index_free(&ci);
+	free(path);
+}
+
+static void *merge_shards(void *arg)
+{
+	struct merge_task *mt = arg;
 
-	i = fp->table[search_key[key_len - 1] - 1].rpi;
-	p = fp->table[i].fst;
-	l = fp->table[i].lst;
+	fpt_merge(mt->dst, mt->src);
+	free(mt->src->nodes);
+	return NULL;
+}
+
+/**
+ * Run fun on each of the n arguments of size sz from arg, in parallel.
+ */
+static void run_parallel(void *arg, size_t n, size_t sz, void *(*fun)(void *))
+{
+	pthread_t *th;
+	size_t i;
 
-	while (p && p != l) {
-		count += search_on_path(p, search_key, key_len);
-		p = p->next;
+	if (n == 1) {
+		fun(arg);
+		return;
 	}
+
+	th = calloc(n, sizeof(th[0]));
+	for (i = 0; i < n; i++)
+		if (pthread_create(&th[i], NULL, fun, (char *)arg + i * sz))
+			die("Unable to start thread %lu", i);
+	for (i = 0; i < n; i++)
+		pthread_join(th[i], NULL);
+	free(th);
+}
+
+/**
+ * Assign the global item ids, in the increasing order of the ids from the
+ * file, and set the translation from the local ids of each shard.
+ */
+static void merge_dicts(struct shard *sh, size_t nsh, struct fptree *fp)
+{
+	size_t i, j, k, tot = 0, *cnt, *p;
+
+	for (i = 0; i < nsh; i++)
+		tot += sh[i].d.n;
+	fp->ids = calloc(tot + 1, sizeof(fp->ids[0]));
+	for (i = 0, k = 0; i < nsh; i++)
+		for (j = 1; j <= sh[i].d.n; j++)
+			fp->ids[k++] = sh[i].d.ids[j];
+	qsort(fp->ids, tot, sizeof(fp->ids[0]), size_cmp);
+	for (j = 0, k = 0; j < tot; j++)
+		if (!k || fp->ids[k - 1] != fp->ids[j])
+			fp->ids[k++] = fp->ids[j];
+
+	cnt = calloc(k + 1, sizeof(cnt[0]));
+	for (i = 0; i < nsh; i++) {
+		sh[i].remap = calloc(sh[i].d.n + 1, sizeof(sh[i].remap[0]));
+		for (j = 1; j <= sh[i].d.n; j++) {
+			p = bsearch(&sh[i].d.ids[j], fp->ids, k,
+					sizeof(fp->ids[0]), size_cmp);
+			sh[i].remap[j] = p - fp->ids + 1;
+			cnt[p - fp->ids] += sh[i].d.cnt[j];
+		}
+		dict_free(&sh[i].d);
+	}
+
+	build_table(cnt, k, fp);
+	free(cnt);
+}
+
+static void print_sample(const struct fptree *fp, size_t lines)
+{
+	if (fp->q < 1)
+		printf("Sampled %lu of about %lu transactions, q = %.4lf\n",
+				fp->t, lines, fp->q);
+}
+
+/**
+ * Build the tree in a from nsh chunks of the input in parallel.
+ *
+ * Each shard builds a private tree over the same global item order and the
+ * trees are merged pairwise, the first shard's tree holding the result.
+ *
+ * If zs is given the shards take blocks from the decompression stream
+ * instead, parsing while the next blocks are decompressed.
+ */
+static void read_shards(const struct input *in, struct zstream *zs,
+		struct fptree *fp, const struct fpt_options *opts, size_t nsh,
+		struct arena *a)
+{
+	struct shard *sh = calloc(nsh, sizeof(sh[0]));
+	struct merge_task *mt = calloc(nsh, sizeof(mt[0]));
+	size_t i, k, stride, lines;
+
+	if (!zs)
+		split_input(in, sh, nsh);
+	for (i = 0; i < nsh; i++) {
+		sh[i].zs = zs;
+		tbuf_init(&sh[i].tb);
+		dict_init(&sh[i].d);
+		sampler_init(&sh[i].sm, opts, zs ? NULL : in->data, zs ? i : 0);
+	}
+
+	printf("Reading transactions ... ");
+	fflush(stdout);
+	run_parallel(sh, nsh, sizeof(sh[0]), shard_parse);
+	for (i = 0, fp->t = 0, lines = 0; i < nsh; i++) {
+		fp->t += sh[i].tb.ntr;
+		lines += sh[i].sm.line;
+	}
+	merge_dicts(sh, nsh, fp);
+	printf("OK\n");
+	print_sample(fp, lines);
+	select_items(fp, opts);
+
+	printf("Building fp-tree ... ");
+	fflush(stdout);
+	for (i = 0; i < nsh; i++) {
+		sh[i].fp = fp;
+		arena_init(&sh[i].tree);
+	}
+	run_parallel(sh, nsh, sizeof(sh[0]), shard_build);
+	for (i = 0; i < nsh; i++) {
+		tbuf_free(&sh[i].tb);
+		free(sh[i].remap);
+	}
+
+	for (stride = 1; stride < nsh; stride *= 2) {
+		for (i = 0, k = 0; i + stride < nsh; i += 2 * stride, k++) {
+			mt[k].dst = &sh[i].tree;
+			mt[k].src = &sh[i + stride].tree;
+		}
+		run_parallel(mt, k, sizeof(mt[0]), merge_shards);
+	}
+	*a = sh[0].tree;
+	printf("OK\n");
+
+	free(mt);
+	free(sh);
+}
+
+/**
+ * Binary transaction files.
+ *
+ * The header below is followed by the support of each item 1..n (as
+ * uint64_t), by the original id of each item if BIN_IDS is set in flags
+ * (items being their own ids otherwise) and then by r records, one for
+ * each distinct transaction.
+ * A record is a varint multiplicity (only if BIN_MULT is set in flags),
+ * a varint length and the varint deltas between the sorted items, the
+ * first delta being from 0. Transactions with no items are only counted
+ * in t.
+ */
+#define BIN_MAGIC "FPTB"
+#define BIN_MULT 1
+#define BIN_IDS 2
+
+struct bin_header {
+	char magic[4];
+	uint32_t flags;
+	/* number of items, transactions and records */
+	uint64_t n;
+	uint64_t t;
+	uint64_t r;
+};
+
+static int is_binary(const struct input *in)
+{
+	return in->sz >= sizeof(struct bin_header) &&
+		!memcmp(in->data, BIN_MAGIC, sizeof(((struct bin_header *)0)->magic));
+}
+
+static inline uint64_t varint_get(const unsigned char **p,
+		const unsigned char *end)
+{
+	uint64_t x = 0;
+	int sh = 0;
+
+	while (*p < end && sh < 64) {
+		x |= (uint64_t)(**p & 0x7f) << sh;
+		if (!(*(*p)++ & 0x80))
+			return x;
+		sh += 7;
+	}
+
+	die("Corrupted binary transaction file");
+}
+
+static void varint_put(FILE *f, uint64_t x)
+{
+	while (x >= 0x80) {
+		fputc((x & 0x7f) | 0x80, f);
+		x >>= 7;
+	}
+	fputc(x, f);
+}
+
+#define INITIAL_SIZE 100
+
+/**
+ * Build the tree in a from a binary file, the item counts being in the
+ * header.
+ */
+static void read_binary(const struct input *in, struct fptree *fp,
+		const struct fpt_options *opts, struct arena *a)
+{
+	const unsigned char *p, *end = (unsigned char *)in->data + in->sz;
+	size_t i, k, len, isp = INITIAL_SIZE, r;
+	struct bin_header hdr;
+	struct child_index ci;
+	uint64_t x, mult = 1;
+	size_t *cnt;
+	int *items;
+
+	memcpy(&hdr, in->data, sizeof(hdr));
+	p = (unsigned char *)in->data + sizeof(hdr);
+	if ((size_t)(end - p) / sizeof(uint64_t) <
+			(hdr.flags & BIN_IDS ? 2 : 1) * hdr.n)
+		die("Corrupted binary transaction file");
+
+	printf("Reading item counts from header ... ");
+	fflush(stdout);
+	cnt = calloc(hdr.n + 1, sizeof(cnt[0]));
+	memcpy(cnt, p, hdr.n * sizeof(uint64_t));
+	p += hdr.n * sizeof(uint64_t);
+	fp->ids = calloc(hdr.n + 1, sizeof(fp->ids[0]));
+	for (i = 0; i < hdr.n; i++)
+		fp->ids[i] = i + 1;
+	if (hdr.flags & BIN_IDS) {
+		memcpy(fp->ids, p, hdr.n * sizeof(uint64_t));
+		p += hdr.n * sizeof(uint64_t);
+	}
+	fp->t = hdr.t;
+	build_table(cnt, hdr.n, fp);
+	free(cnt);
+	printf("OK\n");
+	select_items(fp, opts);
+
+	printf("Building fp-tree ... ");
+	fflush(stdout);
+	arena_init(a);
+	child_index_init(&ci);
+	items = calloc(isp, sizeof(items[0]));
+	for (r = 0; r < hdr.r; r++) {
+		if (hdr.flags & BIN_MULT)
+			mult = varint_get(&p, end);
+		len = varint_get(&p, end);
+		if (len > isp) {
+			isp = len;
+			items = realloc(items, isp * sizeof(items[0]));
+		}
+		for (i = 0, k = 0, x = 0; i < len; i++) {
+			x += varint_get(&p, end);
+			if (!x || x > fp->n)
+				die("Corrupted binary transaction file");
+			items[k] = fp->table[x - 1].rpi;
+			if (fp->table[items[k]].kept)
+				k++;
+		}
+		qsort(items, k, sizeof(items[0]), int_cmp);
+		for (i = 0; i < k; i++)
+			items[i] = fp->table[items[i]].val;
+		fpt_add_transaction(items, k, mult, a, &ci);
+	}
+	free(items);
+	child_index_free(&ci);
+	printf("OK\n");
+}
+
+#undef INITIAL_SIZE
+
+/* number of transactions ending in each node (not continued in children) */
+static int *fpt_node_ends(const struct fpt_snapshot *s)
+{
+	int *e = calloc(s->nn, sizeof(e[0]));
+	uint32_t x;
+
+	for (x = 0; x < s->nn; x++)
+		e[x] = s->cnt[x];
+	for (x = 1; x < s->nn; x++)
+		e[s->parent[x]] -= s->cnt[x];
+	return e;
+}
+
+static void count_records(const struct fpt_snapshot *s, const int *e,
+		uint64_t *recs, uint32_t *flags)
+{
+	uint32_t x;
+
+	for (x = 1; x < s->nn; x++) {
+		if (e[x] > 0)
+			*recs += 1;
+		if (e[x] > 1)
+			*flags |= BIN_MULT;
+	}
+}
+
+static void write_records(FILE *f, const struct fptree *fp, const int *e,
+		int *tmp, uint32_t flags)
+{
+	const struct fpt_snapshot *s = fp->tree;
+	uint32_t x, y;
+	int j, d;
+
+	for (x = 1; x < s->nn; x++) {
+		if (e[x] <= 0)
+			continue;
+		/* nodes added by updates are not after their ancestors */
+		for (d = 0, y = x; y; y = s->parent[y])
+			tmp[d++] = fp->table[s->rank[y]].val;
+		qsort(tmp, d, sizeof(tmp[0]), int_cmp);
+		if (flags & BIN_MULT)
+			varint_put(f, e[x]);
+		varint_put(f, d);
+		for (j = 0; j < d; j++)
+			varint_put(f, tmp[j] - (j ? tmp[j - 1] : 0));
+	}
+}
+
+void fpt_save_binary(const struct fptree *fp, const char *fname)
+{
+	struct bin_header hdr = { .magic = BIN_MAGIC };
+	int h = fpt_height(fp), *tmp, *e;
+	uint64_t x;
+	size_t i;
+	FILE *f;
+
+	f = fopen(fname, "w");
+	if (!f)
+		die("Unable to save file %s", fname);
+
+	printf("Saving binary transactions to %s ... ", fname);
+	fflush(stdout);
+	hdr.n = fp->n;
+	hdr.t = fp->t;
+	e = fpt_node_ends(fp->tree);
+	count_records(fp->tree, e, &hdr.r, &hdr.flags);
+	for (i = 0; i < fp->n; i++)
+		if (fp->ids[i] != i + 1)
+			hdr.flags |= BIN_IDS;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < fp->n; i++) {
+		x = fp->table[fp->table[i].rpi].cnt;
+		fwrite(&x, sizeof(x), 1, f);
+	}
+	if (hdr.flags & BIN_IDS)
+		for (i = 0; i < fp->n; i++) {
+			x = fp->ids[i];
+			fwrite(&x, sizeof(x), 1, f);
+		}
+
+	tmp = calloc(h, sizeof(tmp[0]));
+	write_records(f, fp, e, tmp, hdr.flags);
+	free(tmp);
+	free(e);
+	printf("OK\n");
+
+	if (fclose(f))
+		die("Unable to save file %s", fname);
+}
+
+/**
+ * The loops over words of bitmaps, kept apart with restrict qualified
+ * arrays for the compiler to vectorize them (build with NATIVE=1).
+ */
+
+/* bits set in the n words of a */
+static int words_count(const uint64_t *restrict a, size_t n)
+{
+	int count = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		count += __builtin_popcountll(a[k]);
+	return count;
+}
+
+/* bits set in the AND of the n words of a and b */
+static int words_and_count(const uint64_t *restrict a,
+		const uint64_t *restrict b, size_t n)
+{
+	int count = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		count += __builtin_popcountll(a[k] & b[k]);
+	return count;
+}
+
+/* d &= a, over n words */
+static void words_and(uint64_t *restrict d, const uint64_t *restrict a,
+		size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		d[k] &= a[k];
+}
+
+/* d = a & x, over n words */
+static void words_and_word(uint64_t *restrict d, const uint64_t *restrict a,
+		uint64_t x, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		d[k] = a[k] & x;
+}
+
+/* d = a & row[word], over n words */
+static void words_and_gather(uint64_t *restrict d, const uint64_t *restrict a,
+		const uint64_t *restrict row, const size_t *restrict word,
+		size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		d[k] = a[k] & row[word[k]];
+}
+
+/* set bits from .. to-1 */
+static void bits_set(uint64_t *w, size_t from, size_t to)
+{
+	for (; from < to && from % 64; from++)
+		w[from / 64] |= 1ULL << from % 64;
+	for (; from + 64 <= to; from += 64)
+		w[from / 64] = ~0ULL;
+	for (; from < to; from++)
+		w[from / 64] |= 1ULL << from % 64;
+}
+
+static void bitmaps_build(struct fptree *fp, size_t nr)
+{
+	struct fpt_bitmaps *b = calloc(1, sizeof(*b));
+	const struct fpt_snapshot *s = fp->tree;
+	size_t *next = calloc(s->nn, sizeof(next[0]));
+	int *e = fpt_node_ends(s);
+	uint32_t x, p;
+	size_t r, i;
+	uint64_t *w;
+
+	/* room for the transactions added by updates */
+	b->nw = (fp->t + (fp->up ? (size_t)(FPT_SLACK * fp->t) + 64 : 0) +
+			63) / 64;
+	b->nr = nr;
+	b->row = calloc(fp->n, sizeof(b->row[0]));
+	b->lo = calloc(nr + 1, sizeof(b->lo[0]));
+	b->hi = calloc(nr + 1, sizeof(b->hi[0]));
+	b->cnt = calloc(nr + 1, sizeof(b->cnt[0]));
+	b->bits = calloc(nr * b->nw + 1, sizeof(b->bits[0]));
+	if (!b->bits)
+		die("Not enough memory for %lu bitmaps", nr);
+	if (fp->up) {
+		b->nn = s->nn;
+		b->home = calloc(s->nn, sizeof(b->home[0]));
+		b->more = calloc(s->nn, sizeof(b->more[0]));
+		b->left = calloc(s->nn, sizeof(b->left[0]));
+	}
+
+	for (r = 0, i = 0; r < fp->n; r++)
+		b->row[r] = s->cstart[r + 1] > s->cstart[r] ? (int)i++ : -1;
+
+	/* transactions ending in x first, then the ones of its children */
+	for (x = 1; x < s->nn; x++) {
+		p = s->parent[x];
+		bits_set(b->bits + b->row[s->rank[x]] * b->nw, next[p],
+				next[p] + s->cnt[x]);
+		if (b->home) {
+			b->home[x] = next[p];
+			b->left[x] = e[x];
+		}
+		next[x] = next[p] + e[x];
+		next[p] += s->cnt[x];
+	}
+	b->nb = b->nb0 = next[0];
+	if (fp->up)
+		b->link = calloc(b->nw * 64 - b->nb0 + 1, sizeof(b->link[0]));
+
+	for (r = 0; r < nr; r++) {
+		w = b->bits + r * b->nw;
+		for (i = 0; i < b->nw && !w[i]; i++);
+		b->lo[r] = i;
+		for (i = b->nw; i > b->lo[r] && !w[i - 1]; i--);
+		b->hi[r] = i;
+		b->cnt[r] = words_count(w + b->lo[r], b->hi[r] - b->lo[r]);
+	}
+
+	free(next);
+	free(e);
+	fp->bm = b;
+}
+
+/**
+ * Pick the backend for the count queries. A query walks a chain of the
+ * tree, longer as the data gets denser, or ANDs a row of bitmaps, a word
+ * per 64 transactions whatever the data. Bitmaps pay off once the chains
+ * are BITMAP_RATIO times longer than the rows, if they fit.
+ */
+static void fpt_choose_backend(struct fptree *fp,
+		const struct fpt_options *opts)
+{
+	const struct fpt_snapshot *s = fp->tree;
+	size_t r, nr = 0, occ = 0, nw = (fp->t + 63) / 64;
+	double density, chain, mb;
+	enum fpt_backend b;
+	uint32_t x;
+
+	for (r = 0; r < fp->n; r++)
+		if (s->cstart[r + 1] > s->cstart[r])
+			nr++;
+	for (x = 1; x < s->nn; x++)
+		occ += s->cnt[x];
+	density = div_or_zero(occ, (double)nr * fp->t);
+	chain = div_or_zero(s->nn - 1, nr);
+	mb = (double)nr * nw * sizeof(uint64_t) / (1 << 20);
+
+	b = opts->backend;
+	if (b == FPT_AUTO)
+		b = chain >= BITMAP_RATIO * nw && mb <= BITMAP_MAX_MB ?
+			FPT_BITMAP : FPT_TREE;
+	fp->bm = NULL;
+	if (b == FPT_BITMAP)
+		bitmaps_build(fp, nr);
+
+	printf("Backend: %s, density %.4lf, %.0lf nodes and %lu words per item, bitmaps %.1lf MiB\n",
+			fp->bm ? "bitmap" : "tree", density, chain, nw, mb);
+}
+
+/* pair counts of the nodes from .. to-1, done by one thread */
+struct pairs_task {
+	const struct fpt_snapshot *s;
+	const int *pix;
+	uint32_t from, to;
+	int *m;
+	/* indices in the matrix of the ancestors of a node, and their depth */
+	int *ix;
+	uint32_t *dep;
+};
+
+static void *pairs_count_nodes(void *arg)
+{
+	struct pairs_task *pt = arg;
+	const struct fpt_snapshot *s = pt->s;
+	int i, k = 0, p, *row;
+	uint32_t x;
+
+	if (pt->from >= pt->to)
+		return NULL;
+
+	/* ancestors of the first node, the root side first */
+	for (x = s->parent[pt->from]; x; x = s->parent[x])
+		if (pt->pix[s->rank[x]] >= 0)
+			k++;
+	for (i = k, x = s->parent[pt->from]; x; x = s->parent[x])
+		if (pt->pix[s->rank[x]] >= 0) {
+			pt->ix[--i] = pt->pix[s->rank[x]];
+			pt->dep[i] = s->depth[x];
+		}
+
+	/* ancestors rank before the node, so they are in its row */
+	for (x = pt->from; x < pt->to; x++) {
+		while (k && pt->dep[k - 1] >= s->depth[x])
+			k--;
+		p = pt->pix[s->rank[x]];
+		if (p < 0)
+			continue;
+		row = pt->m + (size_t)p * (p + 1) / 2;
+		for (i = 0; i < k; i++)
+			row[pt->ix[i]] += s->cnt[x];
+		row[p] += s->cnt[x];
+		pt->ix[k] = p;
+		pt->dep[k++] = s->depth[x];
+	}
+	return NULL;
+}
+
+static void pairs_build(struct fptree *fp, size_t n, size_t threads)
+{
+	struct fpt_pairs *pm = calloc(1, sizeof(*pm));
+	const struct fpt_snapshot *s = fp->tree;
+	size_t r, i, j, sz, nt, maxb = (size_t)PAIRS_MAX_MB << 20;
+	struct pairs_task *pt;
+
+	n = min(n, (size_t)sqrt(2.0 * maxb / sizeof(pm->m[0])));
+	pm->pix = calloc(fp->n + 1, sizeof(pm->pix[0]));
+	for (r = 0, i = 0; r < fp->n; r++)
+		pm->pix[r] = i < n && s->cstart[r + 1] > s->cstart[r] ?
+			(int)i++ : -1;
+	pm->n = i;
+	sz = pm->n * (pm->n + 1) / 2;
+	pm->m = calloc(sz + 1, sizeof(pm->m[0]));
+
+	/* a partial matrix for each thread but the first, if they fit */
+	nt = min(threads, maxb / ((sz + 1) * sizeof(pm->m[0])));
+	nt = max(min(nt, (size_t)s->nn - 1), (size_t)1);
+	pt = calloc(nt, sizeof(pt[0]));
+	for (i = 0; i < nt; i++) {
+		pt[i].s = s;
+		pt[i].pix = pm->pix;
+		pt[i].from = 1 + (s->nn - 1) * i / nt;
+		pt[i].to = 1 + (s->nn - 1) * (i + 1) / nt;
+		pt[i].m = i ? calloc(sz + 1, sizeof(pm->m[0])) : pm->m;
+		pt[i].ix = calloc(s->height, sizeof(pt[i].ix[0]));
+		pt[i].dep = calloc(s->height, sizeof(pt[i].dep[0]));
+	}
+	run_parallel(pt, nt, sizeof(pt[0]), pairs_count_nodes);
+
+	for (i = 0; i < nt; i++) {
+		for (j = 0; i && j < sz; j++)
+			pm->m[j] += pt[i].m[j];
+		if (i)
+			free(pt[i].m);
+		free(pt[i].ix);
+		free(pt[i].dep);
+	}
+	free(pt);
+
+	printf("Pair matrix: %lu items, %.1lf MiB, %lu threads\n", pm->n,
+			(double)sz * sizeof(pm->m[0]) / (1 << 20), nt);
+	fp->pairs = pm;
+}
+
+static void free_snapshot(struct fpt_snapshot *s)
+{
+	if (!s)
+		return;
+	if (s->map) {
+		munmap(s->map, s->mapsz);
+		free(s);
+		return;
+	}
+	free(s->rank);
+	free(s->cnt);
+	free(s->parent);
+	free(s->depth);
+	free(s->cstart);
+	free(s->chain);
+	free(s->anc);
+	free(s->jump);
+	free(s->end);
+	free(s);
+}
+
+static void free_bitmaps(struct fpt_bitmaps *b)
+{
+	if (!b)
+		return;
+	free(b->row);
+	free(b->bits);
+	free(b->lo);
+	free(b->hi);
+	free(b->cnt);
+	free(b->home);
+	free(b->more);
+	free(b->link);
+	free(b->left);
+	free(b);
+}
+
+static void free_pairs(struct fpt_pairs *pm)
+{
+	if (!pm)
+		return;
+	free(pm->pix);
+	free(pm->m);
+	free(pm);
+}
+
+/**
+ * Tree images: a built tree saved as it is in memory, to be mapped read
+ * only by later runs on the same input and shared between them. They are
+ * found by the key of the input file, from its size, inode and time of
+ * modification, without reading it. The hash of its content is kept too,
+ * checked only when asked, as computing it reads the whole input.
+ *
+ * The header below is followed by the arrays of the tree (the table, the
+ * ids and those of the snapshot) at the given offsets from the start of
+ * the file, each one 8-byte aligned. Links in them are node indices, so
+ * the image does not depend on where it is mapped.
+ */
+#define IMG_MAGIC "FPTI"
+#define IMG_VERSION 3
+
+struct img_header {
+	char magic[4];
+	uint32_t version;
+	/* key and hash of the input file, 0 for none */
+	uint64_t key;
+	uint64_t hash;
+	/* size of a table entry, guards against another build */
+	uint64_t tsz;
+	uint64_t n;
+	uint64_t t;
+	uint64_t nn;
+	int64_t height;
+	uint64_t table, ids, rank, cnt, parent, depth, cstart, chain, anc,
+		 jump, end;
+	/* size of the whole image */
+	uint64_t size;
+};
+
+/* identity of the input file, changing when it is rewritten */
+static uint64_t input_key(const struct input *in)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ in->sz, x[3] = {
+		in->dev, in->ino, in->mtime };
+	size_t i;
+
+	for (i = 0; i < 3; i++) {
+		h = (h ^ x[i]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return h ^ h >> 29;
+}
+
+static uint64_t hash_input(const struct input *in)
+{
+	const unsigned char *p = (const unsigned char *)in->data;
+	const unsigned char *end = p + in->sz;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ in->sz, x;
+
+	for (; p + sizeof(x) <= end; p += sizeof(x)) {
+		memcpy(&x, p, sizeof(x));
+		h = (h ^ x) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (x = 0; p < end; p++)
+		x = x << 8 | *p;
+	h = (h ^ x) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ h >> 29;
+}
+
+/* append sz bytes of p to f, 8-byte aligned, returning their offset */
+static uint64_t img_put(FILE *f, const void *p, size_t sz)
+{
+	static const char pad[8];
+	long o = ftell(f);
+
+	fwrite(pad, 1, (8 - o % 8) % 8, f);
+	o = ftell(f);
+	fwrite(p, 1, sz, f);
+	return o;
+}
+
+/* append the arrays of snapshot s of a tree over n items */
+static void img_put_tree(FILE *f, const struct fpt_snapshot *s, size_t n,
+		struct img_header *hdr)
+{
+	hdr->nn = s->nn;
+	hdr->height = s->height;
+	hdr->rank = img_put(f, s->rank, s->nn * sizeof(s->rank[0]));
+	hdr->cnt = img_put(f, s->cnt, s->nn * sizeof(s->cnt[0]));
+	hdr->parent = img_put(f, s->parent, s->nn * sizeof(s->parent[0]));
+	hdr->depth = img_put(f, s->depth, s->nn * sizeof(s->depth[0]));
+	hdr->cstart = img_put(f, s->cstart, (n + 1) * sizeof(s->cstart[0]));
+	hdr->chain = img_put(f, s->chain, s->nn * sizeof(s->chain[0]));
+	hdr->anc = img_put(f, s->anc, s->nn * sizeof(s->anc[0]));
+	hdr->jump = img_put(f, s->jump, s->nn * sizeof(s->jump[0]));
+	hdr->end = img_put(f, s->end, s->nn * sizeof(s->end[0]));
+	hdr->size = ftell(f);
+}
+
+static void image_save(const char *path, uint64_t key, uint64_t hash,
+		const struct fptree *fp)
+{
+	struct img_header hdr = { .magic = IMG_MAGIC };
+	char *tmp = malloc(strlen(path) + 32);
+	FILE *f;
+
+	/* written aside then renamed, for concurrent runs */
+	sprintf(tmp, "%s.%d", path, getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		printf("Unable to save tree image %s\n", tmp);
+		free(tmp);
+		return;
+	}
+
+	hdr.version = IMG_VERSION;
+	hdr.key = key;
+	hdr.hash = hash;
+	hdr.tsz = sizeof(fp->table[0]);
+	hdr.n = fp->n;
+	hdr.t = fp->t;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	hdr.table = img_put(f, fp->table, fp->n * sizeof(fp->table[0]));
+	hdr.ids = img_put(f, fp->ids, fp->n * sizeof(fp->ids[0]));
+	img_put_tree(f, fp->tree, fp->n, &hdr);
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	if (fclose(f) || rename(tmp, path)) {
+		printf("Unable to save tree image %s\n", path);
+		unlink(tmp);
+	} else
+		printf("Saved tree image %s\n", path);
+	free(tmp);
+}
+
+/* whether n entries of sz bytes at offset off, aligned, fit in size bytes */
+static int img_fits(uint64_t off, uint64_t n, uint64_t sz, uint64_t size)
+{
+	return off % 8 == 0 && off >= sizeof(struct img_header) &&
+		off <= size && n <= (size - off) / sz;
+}
+
+/**
+ * Whether the arrays of the snapshot s of n ranks, mapped from an image,
+ * make a tree the queries can walk without leaving them: parents, jumps and
+ * ranks before each node on its path, subtrees inside their parent's, and
+ * chains of the nodes of their rank.
+ */
+static int img_tree_valid(const struct fpt_snapshot *s, uint64_t n)
+{
+	uint32_t x, p, j;
+	uint64_t r;
+
+	if (s->rank[0] != -1 || s->parent[0] || s->jump[0] || s->depth[0] ||
+			s->anc[0] || s->end[0] != s->nn || s->cstart[0] ||
+			s->cstart[n] != s->nn - 1)
+		return 0;
+	for (x = 1; x < s->nn; x++) {
+		p = s->parent[x];
+		if (p >= x || s->jump[x] > p || s->rank[x] <= s->rank[p] ||
+				(uint64_t)s->rank[x] >= n || s->cnt[x] <= 0 ||
+				s->depth[x] != s->depth[p] + 1 ||
+				s->depth[x] >= (uint32_t)s->height ||
+				s->end[x] <= x || s->end[x] > s->end[p] ||
+				s->anc[x] != (s->anc[p] | (s->rank[x] < ANC_BITS ?
+						1ULL << s->rank[x] : 0)))
+			return 0;
+	}
+	for (r = 0; r < n; r++) {
+		if (s->cstart[r] > s->cstart[r + 1])
+			return 0;
+		for (j = s->cstart[r]; j < s->cstart[r + 1]; j++)
+			if (!s->chain[j] || s->chain[j] >= s->nn ||
+					(uint64_t)s->rank[s->chain[j]] != r)
+				return 0;
+	}
+	return 1;
+}
+
+/**
+ * Map the image at path if it is one of the input of the given key (and
+ * hash, unless 0), returning its snapshot (owning the mapping) or NULL if
+ * not. The arrays of a truncated or damaged header are not used, nor the
+ * ones not making a tree.
+ */
+static struct fpt_snapshot *img_map_tree(const char *path, uint64_t key,
+		uint64_t hash)
+{
+	const struct img_header *hdr;
+	struct fpt_snapshot *s;
+	struct stat st;
+	uint64_t size;
+	char *m;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct img_header *)m;
+	size = st.st_size;
+	if (memcmp(hdr->magic, IMG_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != IMG_VERSION || hdr->key != key ||
+			(hash && hdr->hash != hash) ||
+			hdr->tsz != sizeof(struct table) || hdr->size != size ||
+			!hdr->nn || hdr->nn > UINT32_MAX || hdr->n >= INT_MAX ||
+			hdr->height < 1 || (uint64_t)hdr->height > hdr->nn ||
+			!img_fits(hdr->rank, hdr->nn, sizeof(int), size) ||
+			!img_fits(hdr->cnt, hdr->nn, sizeof(int), size) ||
+			!img_fits(hdr->parent, hdr->nn, sizeof(uint32_t), size) ||
+			!img_fits(hdr->depth, hdr->nn, sizeof(uint32_t), size) ||
+			!img_fits(hdr->cstart, hdr->n + 1, sizeof(uint32_t), size) ||
+			!img_fits(hdr->chain, hdr->nn, sizeof(uint32_t), size) ||
+			!img_fits(hdr->anc, hdr->nn, sizeof(uint64_t), size) ||
+			!img_fits(hdr->jump, hdr->nn, sizeof(uint32_t), size) ||
+			!img_fits(hdr->end, hdr->nn, sizeof(uint32_t), size)) {
+		munmap(m, st.st_size);
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	s->nn = hdr->nn;
+	s->height = hdr->height;
+	s->rank = (int *)(m + hdr->rank);
+	s->cnt = (int *)(m + hdr->cnt);
+	s->parent = (uint32_t *)(m + hdr->parent);
+	s->depth = (uint32_t *)(m + hdr->depth);
+	s->cstart = (uint32_t *)(m + hdr->cstart);
+	s->chain = (uint32_t *)(m + hdr->chain);
+	s->anc = (uint64_t *)(m + hdr->anc);
+	s->jump = (uint32_t *)(m + hdr->jump);
+	s->end = (uint32_t *)(m + hdr->end);
+	s->map = m;
+	s->mapsz = st.st_size;
+	if (!img_tree_valid(s, hdr->n)) {
+		free_snapshot(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* map the image at path if it is the one of the input, 0 if not */
+static int image_load(const char *path, uint64_t key, uint64_t hash,
+		struct fptree *fp)
+{
+	struct fpt_snapshot *s = img_map_tree(path, key, hash);
+	const struct img_header *hdr;
+
+	if (!s)
+		return 0;
+	hdr = s->map;
+	if (!img_fits(hdr->table, hdr->n, sizeof(struct table), s->mapsz) ||
+			!img_fits(hdr->ids, hdr->n, sizeof(size_t), s->mapsz)) {
+		free_snapshot(s);
+		return 0;
+	}
+	fp->n = hdr->n;
+	fp->t = hdr->t;
+	fp->table = (struct table *)((char *)s->map + hdr->table);
+	fp->ids = (size_t *)((char *)s->map + hdr->ids);
+	fp->tree = s;
+	return 1;
+}
+
+/* memory budget of partitioned trees if not given, in MiB */
+#ifndef PART_BUDGET_MB
+#define PART_BUDGET_MB 256
+#endif
+
+/* spill files of a partitioned tree, each for a range of ranks */
+#ifndef PART_SLOTS
+#define PART_SLOTS 256
+#endif
+
+/**
+ * A tree larger than the memory budget, split in partitions of contiguous
+ * ranks saved as tree images in dir, FP-growth style: the tree of a
+ * partition holds each transaction with an item in it, cut after its last
+ * such item. The count of an itemset is then found in the tree of the
+ * partition of its last rank alone.
+ *
+ * Partition k has ranks lo[k] to lo[k-1]-1 (lo[-1] being n), the last
+ * ranks in partition 0. Partitions are mapped when queried and the least
+ * recently used ones unmapped once over the budget.
+ */
+struct fpt_parts {
+	char *dir;
+	uint64_t key;
+	size_t np;
+	int *lo;
+	struct fpt_snapshot **s;
+	/* last query of each partition, on the clock of the queries */
+	size_t *used, clock;
+	/* partitions mapped so far */
+	size_t loads;
+	/* in bytes, the most used while building and mapped at once */
+	size_t budget, mapped, build_peak, peak;
+	/* nodes but the roots and levels of the partitions together */
+	uint32_t nn;
+	int height;
+};
+
+/* path of partition k, or of spill file k if slot */
+static char *part_path(const struct fpt_parts *ps, size_t k, int slot)
+{
+	char *path = malloc(strlen(ps->dir) + 64);
+
+	sprintf(path, "%s/%016lx.%d.%s%lu", ps->dir, ps->key, getpid(),
+			slot ? "slot" : "part", k);
+	return path;
+}
+
+/* a transaction of ranks in a spill file, mark being the partition (plus
+ * one) whose tree has it already, 0 for none */
+static void spill_put(FILE *f, const int *rs, int len, int mark)
+{
+	int i;
+
+	varint_put(f, mark);
+	varint_put(f, len);
+	for (i = 0; i < len; i++)
+		varint_put(f, rs[i] - (i ? rs[i - 1] : 0));
+}
+
+static uint64_t spill_varint(FILE *f)
+{
+	uint64_t x = 0;
+	int c, sh = 0;
+
+	while ((c = getc(f)) != EOF && sh < 64) {
+		x |= (uint64_t)(c & 0x7f) << sh;
+		if (!(c & 0x80))
+			return x;
+		sh += 7;
+	}
+
+	die("Corrupted spill file");
+}
+
+/* next transaction of a spill file in *rs (of size *sz), 0 at the end */
+static int spill_get(FILE *f, int **rs, size_t *sz, int *len, int *mark)
+{
+	int c, i;
+
+	if ((c = getc(f)) == EOF)
+		return 0;
+	ungetc(c, f);
+	*mark = spill_varint(f);
+	*len = spill_varint(f);
+	if ((size_t)*len > *sz) {
+		*sz = *len;
+		*rs = realloc(*rs, *sz * sizeof((*rs)[0]));
+	}
+	for (i = 0; i < *len; i++)
+		(*rs)[i] = spill_varint(f) + (i ? (*rs)[i - 1] : 0);
+	return 1;
+}
+
+/* spill files, the first rank of each and its remap to the global ids */
+struct part_spill {
+	const struct fptree *fp;
+	const int *remap;
+	FILE **f;
+	size_t nslots;
+	size_t *slo;
+	size_t *tb_peak;
+};
+
+static inline size_t part_slot(const struct part_spill *sp, int r)
+{
+	return (size_t)r * sp->nslots / sp->fp->n;
+}
+
+/* write the transactions of tb to the spill file of their last rank */
+static void part_spill_chunk(struct tbuf *tb, void *arg)
+{
+	struct part_spill *sp = arg;
+	const struct table *table = sp->fp->table;
+	size_t t, i, l;
+	int *items;
+
+	*sp->tb_peak = max(*sp->tb_peak, tb->sitems * sizeof(tb->items[0]) +
+			tb->sstart * sizeof(tb->start[0]));
+	for (t = 0; t < tb->ntr; t++) {
+		items = tb->items + tb->start[t];
+		for (i = 0, l = 0; i < tb->start[t + 1] - tb->start[t]; i++) {
+			items[l] = table[sp->remap[items[i]] - 1].rpi;
+			if (table[items[l]].kept)
+				l++;
+		}
+		if (!l)
+			continue;
+		sort_items(items, l);
+		spill_put(sp->f[part_slot(sp, items[l - 1])], items, l, 0);
+	}
+}
+
+static void count_chunk(struct tbuf *tb, void *arg)
+{
+	size_t *t = arg;
+
+	*t += tb->ntr;
+}
+
+/**
+ * Parse the input a chunk of at most about chunk bytes (or a block of
+ * compressed input) at a time, calling fun on the transactions of each.
+ * Pages of the input are released once parsed.
+ */
+static void scan_input(const struct input *in, enum zformat zf,
+		size_t chunk, struct dict *d, struct sampler *sm,
+		void (*fun)(struct tbuf *tb, void *arg), void *arg)
+{
+	const char *p = in->data, *end = in->data + in->sz, *q;
+	size_t len, pg = sysconf(_SC_PAGESIZE);
+	struct zstream *zs = NULL;
+	struct tbuf tb;
+	char *blk;
+
+	if (zf != ZF_NONE)
+		zs = zstream_open(in->data, in->sz, zf);
+	tbuf_init(&tb);
+	for (;;) {
+		if (zs) {
+			if (!(blk = zstream_next(zs, &len)))
+				break;
+			parse_transactions(blk, blk + len, &tb, d, sm);
+			free(blk);
+		} else {
+			if (p == end)
+				break;
+			q = p + min(chunk, (size_t)(end - p));
+			if (q < end)
+				q = memchr(q, '\n', end - q);
+			q = q && q < end ? q + 1 : end;
+			parse_transactions(p, q, &tb, d, sm);
+			madvise(in->data + (p - in->data) / pg * pg,
+					(q - p) / pg * pg, MADV_DONTNEED);
+			p = q;
+		}
+		fun(&tb, arg);
+		tb.nitems = tb.ntr = 0;
+	}
+	tbuf_free(&tb);
+	if (zs)
+		zstream_close(zs);
+}
+
+/* freeze the tree in a as partition k and save it */
+static void part_save(struct fptree *fp, struct fpt_parts *ps,
+		const struct arena *a, size_t k)
+{
+	struct img_header hdr = { .magic = IMG_MAGIC };
+	char *path = part_path(ps, k, 0);
+	FILE *f = fopen(path, "w");
+
+	if (!f)
+		die("Unable to save partition %s", path);
+	fpt_freeze(a, fp, NULL);
+	hdr.version = IMG_VERSION;
+	hdr.key = ps->key;
+	hdr.tsz = sizeof(fp->table[0]);
+	hdr.n = fp->n;
+	hdr.t = fp->t;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	img_put_tree(f, fp->tree, fp->n, &hdr);
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	if (fclose(f))
+		die("Unable to save partition %s", path);
+
+	ps->nn += fp->tree->nn - 1;
+	ps->height = max(ps->height, fp->tree->height);
+	free_snapshot(fp->tree);
+	fp->tree = NULL;
+	free(path);
+}
+
+/**
+ * Build a partitioned tree in two passes over the input: one counting the
+ * items and one writing each transaction, as ranks, to the spill file of
+ * the range of its last rank. The spill files are then read from the last
+ * ranks to the first ones, each transaction read going into the tree of
+ * the current partition (unless there already) and, cut before the ranks
+ * of its file, to the spill file of its new last rank. A partition ends
+ * once its tree takes half of the budget.
+ */
+static void read_parts(const struct input *in, enum zformat zf,
+		struct fptree *fp, const struct fpt_options *opts)
+{
+	struct fpt_parts *ps = calloc(1, sizeof(*ps));
+	size_t i, k, sl, sz = 0, vsz = 0, tb_peak = 0, mem, slo_r;
+	struct part_spill sp = { .fp = fp, .tb_peak = &tb_peak };
+	struct shard sh = { 0 };
+	struct child_index ci;
+	struct sampler sm;
+	int *rs = NULL, *vals = NULL;
+	int len, l, mark;
+	struct arena a;
+	char *path;
+
+	if (is_binary(in))
+		die("Partitioned trees are built from text transaction files");
+	ps->dir = strdup(opts->part_dir);
+	ps->key = input_key(in);
+	ps->budget = (opts->part_mb ? opts->part_mb : PART_BUDGET_MB) << 20;
+
+	printf("Reading transactions ... ");
+	fflush(stdout);
+	fp->t = 0;
+	dict_init(&sh.d);
+	sampler_init(&sm, opts, zf != ZF_NONE ? NULL : in->data, 0);
+	scan_input(in, zf, ps->budget / 8, &sh.d, &sm, count_chunk, &fp->t);
+	merge_dicts(&sh, 1, fp);
+	printf("OK\n");
+	print_sample(fp, sm.line);
+	select_items(fp, opts);
+
+	/* the same input gives the same local ids, in order of appearance */
+	printf("Spilling transactions to %s ... ", ps->dir);
+	fflush(stdout);
+	sp.remap = sh.remap;
+	sp.nslots = min((size_t)PART_SLOTS, fp->n);
+	sp.f = calloc(sp.nslots + 1, sizeof(sp.f[0]));
+	sp.slo = calloc(sp.nslots + 1, sizeof(sp.slo[0]));
+	for (sl = 0; sl < sp.nslots; sl++) {
+		sp.slo[sl] = (sl * fp->n + sp.nslots - 1) / sp.nslots;
+		path = part_path(ps, sl, 1);
+		if (!(sp.f[sl] = fopen(path, "w+")))
+			die("Unable to create spill file %s", path);
+		unlink(path);
+		free(path);
+	}
+	dict_init(&sh.d);
+	sampler_init(&sm, opts, zf != ZF_NONE ? NULL : in->data, 0);
+	scan_input(in, zf, ps->budget / 8, &sh.d, &sm, part_spill_chunk, &sp);
+	dict_free(&sh.d);
+	free(sh.remap);
+	printf("OK\n");
+
+	printf("Building fp-tree partitions ... ");
+	fflush(stdout);
+	ps->lo = calloc(sp.nslots + 1, sizeof(ps->lo[0]));
+	for (sl = sp.nslots, k = 0, a.nodes = NULL; sl-- > 0;) {
+		if (!a.nodes) {
+			arena_init(&a);
+			child_index_init(&ci);
+		}
+		slo_r = sp.slo[sl];
+		rewind(sp.f[sl]);
+		while (spill_get(sp.f[sl], &rs, &sz, &len, &mark)) {
+			if (mark != (int)k + 1) {
+				if (vsz < sz) {
+					vsz = sz;
+					vals = realloc(vals, vsz * sizeof(vals[0]));
+				}
+				for (i = 0; i < (size_t)len; i++)
+					vals[i] = fp->table[rs[i]].val;
+				fpt_add_transaction(vals, len, 1, &a, &ci);
+			}
+			for (l = len; l > 0 && (size_t)rs[l - 1] >= slo_r; l--);
+			if (l)
+				spill_put(sp.f[part_slot(&sp, rs[l - 1])], rs, l,
+						k + 1);
+		}
+		fclose(sp.f[sl]);
+
+		mem = a.sz * sizeof(a.nodes[0]) + ci.hsz *
+			(sizeof(ci.keys[0]) + sizeof(ci.vals[0]));
+		ps->build_peak = max(ps->build_peak, mem + tb_peak);
+		if (2 * mem < ps->budget && sl)
+			continue;
+		ps->lo[k] = slo_r;
+		part_save(fp, ps, &a, k++);
+		free(a.nodes);
+		a.nodes = NULL;
+		child_index_free(&ci);
+	}
+	free(vals);
+	free(rs);
+	free(sp.f);
+	free(sp.slo);
+
+	ps->np = k;
+	ps->nn++;
+	ps->s = calloc(ps->np + 1, sizeof(ps->s[0]));
+	ps->used = calloc(ps->np + 1, sizeof(ps->used[0]));
+	fp->parts = ps;
+	printf("OK\n");
+	printf("Partitions: %lu in %s, budget %lu MiB, build peak %.1lf MiB\n",
+			ps->np, ps->dir, ps->budget >> 20,
+			(double)ps->build_peak / (1 << 20));
+}
+
+/* partition of rank r */
+static size_t part_of(const struct fpt_parts *ps, int r)
+{
+	size_t lo = 0, hi = ps->np - 1, m;
+
+	/* the first one starting at r or before, starts decrease */
+	while (lo < hi) {
+		m = (lo + hi) / 2;
+		if (ps->lo[m] <= r)
+			hi = m;
+		else
+			lo = m + 1;
+	}
+	return lo;
+}
+
+/* map the partition of rank r, unmapping others to stay in the budget */
+static const struct fpt_snapshot *part_load(struct fpt_parts *ps, int r)
+{
+	size_t k = part_of(ps, r), j, lru;
+	struct fpt_snapshot *s;
+	char *path;
+
+	ps->used[k] = ++ps->clock;
+	if (ps->s[k])
+		return ps->s[k];
+
+	path = part_path(ps, k, 0);
+	if (!(s = img_map_tree(path, ps->key, 0)))
+		die("Unable to map partition %s", path);
+	free(path);
+	for (;;) {
+		for (j = 0, lru = ps->np; j < ps->np; j++)
+			if (ps->s[j] && (lru == ps->np ||
+						ps->used[j] < ps->used[lru]))
+				lru = j;
+		if (lru == ps->np || ps->mapped + s->mapsz <= ps->budget)
+			break;
+		ps->mapped -= ps->s[lru]->mapsz;
+		free_snapshot(ps->s[lru]);
+		ps->s[lru] = NULL;
+	}
+	ps->s[k] = s;
+	ps->mapped += s->mapsz;
+	ps->peak = max(ps->peak, ps->mapped);
+	ps->loads++;
+	return s;
+}
+
+static void free_parts(struct fpt_parts *ps)
+{
+	struct rusage ru;
+	char *path;
+	size_t k;
+
+	if (!ps)
+		return;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("Partitions: %lu mapped, peak %.1lf MiB mapped and %.1lf MiB building of %lu MiB, process peak %.1lf MiB\n",
+			ps->loads, (double)ps->peak / (1 << 20),
+			(double)ps->build_peak / (1 << 20), ps->budget >> 20,
+			ru.ru_maxrss / 1024.0);
+	for (k = 0; k < ps->np; k++) {
+		if (ps->s[k])
+			free_snapshot(ps->s[k]);
+		path = part_path(ps, k, 0);
+		unlink(path);
+		free(path);
+	}
+	free(ps->dir);
+	free(ps->lo);
+	free(ps->s);
+	free(ps->used);
+	free(ps);
+}
+
+#undef PART_SLOTS
+
+#undef IMG_MAGIC
+#undef IMG_VERSION
+
+void fpt_read_from_file(const char *fname, struct fptree *fp,
+		const struct fpt_options *opts)
+{
+	size_t nsh = opts->threads > 1 ? opts->threads : 1;
+	struct zstream *zs = NULL;
+	uint64_t key = 0, hash = 0;
+	char *img = NULL;
+	enum zformat zf;
+	struct arena a;
+	uint32_t x;
+	struct input in;
+
+	map_file(fname, &in);
+
+	fp->q = opts->sample > 0 && opts->sample < 1 ? opts->sample : 1;
+	fp->up = NULL;
+	fp->parts = NULL;
+	fp->bm = NULL;
+	fp->pairs = NULL;
+	if (opts->part_dir) {
+		read_parts(&in, zstream_format(in.data, in.sz), fp, opts);
+		fp->tree = NULL;
+		printf("Backend: tree, %lu partitions\n", fp->parts->np);
+		goto done;
+	}
+
+	/* images hold whole trees, not projected, sampled or for updates */
+	if (opts->image_dir && !opts->select && !opts->updatable &&
+			fp->q == 1) {
+		key = input_key(&in);
+		if (opts->image_verify)
+			hash = hash_input(&in);
+		img = malloc(strlen(opts->image_dir) + 32);
+		sprintf(img, "%s/%016lx.fpti", opts->image_dir, key);
+		if (image_load(img, key, hash, fp)) {
+			printf("Loaded tree image %s\n", img);
+			goto built;
+		}
+	}
+
+	zf = zstream_format(in.data, in.sz);
+	if (zf != ZF_NONE)
+		zs = zstream_open(in.data, in.sz, zf);
+
+	if (!zs && is_binary(&in)) {
+		if (fp->q < 1)
+			die("Sampled trees are built from text transaction files");
+		read_binary(&in, fp, opts, &a);
+	} else
+		read_shards(&in, zs, fp, opts, nsh, &a);
+	if (opts->updatable) {
+		fp->up = calloc(1, sizeof(*fp->up));
+		fp->up->a = a;
+		child_index_init(&fp->up->ci);
+		fp->up->nix = a.n;
+		fp->up->ix = calloc(a.n, sizeof(fp->up->ix[0]));
+		fp->up->opts = *opts;
+		fp->up->n0 = fp->n;
+		fp->up->empty = fp->t;
+		for (x = a.nodes[0].child; x; x = a.nodes[x].sibling)
+			fp->up->empty -= a.nodes[x].cnt;
+		fpt_freeze(&a, fp, fp->up->ix);
+	} else {
+		fpt_freeze(&a, fp, NULL);
+		free(a.nodes);
+	}
+	if (img)
+		image_save(img, key, hash ? hash : hash_input(&in), fp);
+
+built:
+	free(img);
+	fpt_choose_backend(fp, opts);
+	if (opts->pairs)
+		pairs_build(fp, opts->pairs, nsh);
+
+	if (zs)
+		zstream_close(zs);
+done:
+	unmap_file(&in);
+}
+
+void fpt_cleanup(const struct fptree *fp)
+{
+	/* all in the image, if mapped from one */
+	if (!fp->tree || !fp->tree->map) {
+		free(fp->table);
+		free(fp->ids);
+	}
+	free_snapshot(fp->tree);
+	free_parts(fp->parts);
+	free_bitmaps(fp->bm);
+	free_pairs(fp->pairs);
+	if (fp->up) {
+		free(fp->up->a.nodes);
+		child_index_free(&fp->up->ci);
+		free(fp->up->ix);
+		free(fp->up->touched);
+		free(fp->up->log);
+		free(fp->up->added);
+		free(fp->up);
+	}
+}
+
+static void updates_log(struct fpt_updates *u, int x)
+{
+	if (u->nlog == u->szlog) {
+		u->szlog = u->szlog ? 2 * u->szlog : 1024;
+		u->log = realloc(u->log, u->szlog * sizeof(u->log[0]));
+	}
+	u->log[u->nlog++] = x;
+}
+
+static void updates_touch(struct fpt_updates *u, uint32_t x)
+{
+	if (u->nt == u->szt) {
+		u->szt = u->szt ? 2 * u->szt : 1024;
+		u->touched = realloc(u->touched,
+				u->szt * sizeof(u->touched[0]));
+	}
+	u->touched[u->nt++] = x;
+}
+
+/* sorted ranks of the items of an update, -1 if unknown or repeated */
+static int update_ranks(const struct fptree *fp, const int *items, int len,
+		int *rs)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (items[i] < 1 || (size_t)items[i] > fp->n)
+			return -1;
+		rs[i] = fp->table[items[i] - 1].rpi;
+	}
+	sort_items(rs, len);
+	for (i = 1; i < len; i++)
+		if (rs[i] == rs[i - 1])
+			return -1;
+	return 0;
+}
+
+/* if n copies of the transaction of the l ranks in ks end in the tree */
+static int update_found(const struct fptree *fp, const int *ks, int l,
+		int n)
+{
+	struct fpt_updates *u = fp->up;
+	const struct fptree_node *nodes;
+	uint32_t p, x;
+	int i, e;
+
+	for (i = 0, p = 0; i < l; i++, p = x)
+		if (!(x = child_find(&u->a, &u->ci, p, fp->table[ks[i]].val)))
+			return 0;
+	if (!l)
+		return u->empty >= (size_t)n;
+
+	nodes = u->a.nodes;
+	for (e = nodes[p].cnt, x = nodes[p].child; x; x = nodes[x].sibling)
+		e -= nodes[x].cnt;
+	return e >= n;
+}
+
+int fpt_update(struct fptree *fp, const int *items, int len, int w)
+{
+	struct fpt_updates *u = fp->up;
+	int i, l, *rs, *ks;
+	uint32_t p, x;
+
+	if (!u)
+		die("fp-tree not loaded for updates");
+	if (!w)
+		return 0;
+
+	rs = calloc(2 * len + 1, sizeof(rs[0]));
+	ks = rs + len;
+	if (update_ranks(fp, items, len, rs) < 0) {
+		free(rs);
+		return -1;
+	}
+	/* only the items kept are on the path */
+	for (i = 0, l = 0; i < len; i++)
+		if (fp->table[rs[i]].kept)
+			ks[l++] = rs[i];
+	if (w < 0 && !update_found(fp, ks, l, -w)) {
+		free(rs);
+		return -1;
+	}
+
+	if (!l)
+		u->empty += w;
+	for (i = 0, p = 0; i < l; i++, p = x) {
+		x = child_find(&u->a, &u->ci, p, fp->table[ks[i]].val);
+		if (!x) {
+			x = child_add(&u->a, &u->ci, p, fp->table[ks[i]].val, w);
+			continue;
+		}
+		u->a.nodes[x].cnt += w;
+		if (x < u->nix)
+			updates_touch(u, x);
+	}
+
+	updates_log(u, w);
+	updates_log(u, len);
+	updates_log(u, p);
+	for (i = 0; i < len; i++)
+		updates_log(u, rs[i]);
+
+	free(rs);
+	return 0;
+}
+
+/**
+ * New item for the file id id, not seen yet, ranked last with a count of 0.
+ * The arrays of the ranks get room for it.
+ */
+static int item_add(struct fptree *fp, size_t id)
+{
+	struct fpt_updates *u = fp->up;
+	struct fpt_snapshot *s = fp->tree;
+	size_t n = fp->n, k = n - u->n0, i;
+
+	fp->table = realloc(fp->table, (n + 1) * sizeof(fp->table[0]));
+	fp->table[n].val = n + 1;
+	fp->table[n].cnt = 0;
+	fp->table[n].rpi = n;
+	fp->table[n].kept = 1;
+	fp->ids = realloc(fp->ids, (n + 1) * sizeof(fp->ids[0]));
+	fp->ids[n] = id;
+	s->cstart = realloc(s->cstart, (n + 2) * sizeof(s->cstart[0]));
+	s->cstart[n + 1] = s->cstart[n];
+	if (fp->bm) {
+		fp->bm->row = realloc(fp->bm->row,
+				(n + 1) * sizeof(fp->bm->row[0]));
+		fp->bm->row[n] = -1;
+	}
+	if (fp->pairs) {
+		fp->pairs->pix = realloc(fp->pairs->pix,
+				(n + 2) * sizeof(fp->pairs->pix[0]));
+		fp->pairs->pix[n] = -1;
+	}
+
+	u->added = realloc(u->added, (k + 1) * sizeof(u->added[0]));
+	for (i = k; i > 0 && fp->ids[u->added[i - 1] - 1] > id; i--)
+		u->added[i] = u->added[i - 1];
+	u->added[i] = n + 1;
+	fp->n++;
+	return n + 1;
+}
+
+int fpt_update_ids(struct fptree *fp, const size_t *ids, int len, int w)
+{
+	int *its, i, ret = -1;
+	size_t *sorted;
+
+	if (!fp->up)
+		die("fp-tree not loaded for updates");
+
+	its = calloc(len + 1, sizeof(its[0]));
+	sorted = calloc(len + 1, sizeof(sorted[0]));
+	memcpy(sorted, ids, len * sizeof(ids[0]));
+	qsort(sorted, len, sizeof(sorted[0]), size_cmp);
+	for (i = 1; i < len; i++)
+		if (sorted[i] == sorted[i - 1])
+			goto out;
+	for (i = 0; i < len; i++)
+		if (!(its[i] = fpt_id_item(fp, ids[i])) && w <= 0)
+			goto out;
+	for (i = 0; i < len; i++)
+		if (!its[i])
+			its[i] = item_add(fp, ids[i]);
+	ret = fpt_update(fp, its, len, w);
+out:
+	free(its);
+	free(sorted);
+	return ret;
+}
+
+/**
+ * Rank the items again by their counts and rebuild the arena in the new
+ * order, from the transactions ending in each of its nodes. The pair
+ * matrix keeps its items, at their new ranks.
+ */
+static void rebalance(struct fptree *fp)
+{
+	struct fpt_updates *u = fp->up;
+	const struct fptree_node *nodes = u->a.nodes;
+	int *e, *path, *t, *pix = NULL, i, d = 0;
+	struct child_index ci;
+	struct arena a;
+	uint32_t x;
+	size_t v;
+
+	if (fp->pairs) {
+		pix = calloc(fp->n + 1, sizeof(pix[0]));
+		for (v = 0; v < fp->n; v++)
+			pix[v] = fp->pairs->pix[fp->table[v].rpi];
+	}
+	order_table(fp);
+	if (pix) {
+		for (v = 0; v < fp->n; v++)
+			fp->pairs->pix[fp->table[v].rpi] = pix[v];
+		free(pix);
+	}
+
+	e = calloc(u->a.n, sizeof(e[0]));
+	for (x = 1; x < u->a.n; x++) {
+		e[x] += nodes[x].cnt;
+		e[nodes[x].parent] -= nodes[x].cnt;
+	}
+
+	i = fpt_get_height(nodes);
+	path = calloc(i + 1, sizeof(path[0]));
+	t = calloc(i + 1, sizeof(t[0]));
+	arena_init(&a);
+	child_index_init(&ci);
+	for (x = fpt_node_walk(nodes, 0, &d); x; x = fpt_node_walk(nodes, x, &d)) {
+		while (x && !nodes[x].cnt)
+			x = fpt_node_skip(nodes, x, &d);
+		if (!x)
+			break;
+		/* path holds the new ranks from the root down to x */
+		path[d - 1] = fp->table[nodes[x].val - 1].rpi;
+		if (e[x] <= 0)
+			continue;
+		for (i = 0; i < d; i++)
+			t[i] = path[i];
+		sort_items(t, d);
+		for (i = 0; i < d; i++)
+			t[i] = fp->table[t[i]].val;
+		fpt_add_transaction(t, d, e[x], &a, &ci);
+	}
+
+	free(e);
+	free(path);
+	free(t);
+	free(u->a.nodes);
+	child_index_free(&u->ci);
+	u->a = a;
+	u->ci = ci;
+}
+
+/* freeze the whole arena again, leaving out its empty nodes */
+static void refreeze(struct fptree *fp)
+{
+	struct fpt_updates *u = fp->up;
+
+	free_snapshot(fp->tree);
+	free(u->ix);
+	u->nix = u->a.n;
+	u->ix = calloc(u->nix, sizeof(u->ix[0]));
+	fpt_freeze(&u->a, fp, u->ix);
+	u->dead = 0;
+}
+
+/* add arena node x, whose parent is in it, at the end of the snapshot */
+static void snapshot_add(struct fptree *fp, uint32_t x)
+{
+	struct fpt_snapshot *s = fp->tree;
+	struct fpt_updates *u = fp->up;
+	uint32_t y, p;
+
+	if (s->nn == s->cap) {
+		s->cap += s->cap / 8 + 16;
+		s->rank = realloc(s->rank, s->cap * sizeof(s->rank[0]));
+		s->cnt = realloc(s->cnt, s->cap * sizeof(s->cnt[0]));
+		s->parent = realloc(s->parent, s->cap * sizeof(s->parent[0]));
+		s->depth = realloc(s->depth, s->cap * sizeof(s->depth[0]));
+		s->chain = realloc(s->chain, s->cap * sizeof(s->chain[0]));
+		s->anc = realloc(s->anc, s->cap * sizeof(s->anc[0]));
+		s->jump = realloc(s->jump, s->cap * sizeof(s->jump[0]));
+		s->end = realloc(s->end, s->cap * sizeof(s->end[0]));
+	}
+
+	y = s->nn++;
+	s->added++;
+	u->ix[x] = y;
+	s->rank[y] = fp->table[u->a.nodes[x].val - 1].rpi;
+	s->cnt[y] = u->a.nodes[x].cnt;
+	s->parent[y] = p = u->ix[u->a.nodes[x].parent];
+	s->depth[y] = s->depth[p] + 1;
+	s->anc[y] = s->anc[p];
+	if (s->rank[y] < ANC_BITS)
+		s->anc[y] |= 1ULL << s->rank[y];
+	if (s->depth[p] - s->depth[s->jump[p]] ==
+			s->depth[s->jump[p]] - s->depth[s->jump[s->jump[p]]])
+		s->jump[y] = s->jump[s->jump[p]];
+	else
+		s->jump[y] = p;
+	s->end[y] = y + 1;
+	s->height = max(s->height, (int)s->depth[y] + 1);
+}
+
+/**
+ * Put the nodes added from n0 on in their chains, after the others. Only
+ * the chains after the first one growing move, each by the nodes added to
+ * those before it.
+ */
+static void chains_add(const struct fptree *fp, uint32_t n0)
+{
+	struct fpt_snapshot *s = fp->tree;
+	uint32_t y, *c = calloc(fp->n + 1, sizeof(c[0]));
+	size_t r, k, lo = fp->n;
+
+	for (y = n0; y < s->nn; y++) {
+		c[s->rank[y]]++;
+		lo = min(lo, (size_t)s->rank[y]);
+	}
+	/* c[r] becomes the nodes added to the chains before r */
+	for (r = lo, k = 0; r <= fp->n; r++) {
+		y = c[r];
+		c[r] = k;
+		k += y;
+	}
+	for (r = fp->n; r-- > lo; )
+		memmove(s->chain + s->cstart[r] + c[r], s->chain + s->cstart[r],
+				(s->cstart[r + 1] - s->cstart[r]) *
+				sizeof(s->chain[0]));
+	for (r = lo; r <= fp->n; r++)
+		s->cstart[r] += c[r];
+	/* the slots left at the end of each chain, filled from the last one */
+	for (r = lo; r < fp->n; r++)
+		c[r] = s->cstart[r + 1];
+	for (y = s->nn; y-- > n0; )
+		s->chain[--c[s->rank[y]]] = y;
+	free(c);
+}
+/* add w times the pairs of the ranks rs to the pair matrix */
+static void pairs_add(struct fpt_pairs *pm, const int *rs, int len, int w)
+{
+	int i, j, a, b;
+
+	for (i = 0; i < len; i++) {
+		if ((b = pm->pix[rs[i]]) < 0)
+			continue;
+		for (j = 0; j <= i; j++)
+			if ((a = pm->pix[rs[j]]) >= 0)
+				pm->m[(size_t)max(a, b) * (max(a, b) + 1) / 2 +
+					min(a, b)] += w;
+	}
+}
+
+static void bitmaps_rebuild(struct fptree *fp)
+{
+	const struct fpt_snapshot *s = fp->tree;
+	size_t r, nr = 0;
+
+	for (r = 0; r < fp->n; r++)
+		if (s->cstart[r + 1] > s->cstart[r])
+			nr++;
+	free_bitmaps(fp->bm);
+	bitmaps_build(fp, nr);
+}
+
+/* room in the arrays of the nodes for the first nn nodes of the snapshot */
+static void bitmaps_grow(struct fpt_bitmaps *b, uint32_t nn)
+{
+	uint32_t k = b->nn;
+
+	if (nn <= b->nn)
+		return;
+	b->nn = nn + nn / 8;
+	b->home = realloc(b->home, b->nn * sizeof(b->home[0]));
+	b->more = realloc(b->more, b->nn * sizeof(b->more[0]));
+	b->left = realloc(b->left, b->nn * sizeof(b->left[0]));
+	memset(b->home + k, 0, (b->nn - k) * sizeof(b->home[0]));
+	memset(b->more + k, 0, (b->nn - k) * sizeof(b->more[0]));
+	memset(b->left + k, 0, (b->nn - k) * sizeof(b->left[0]));
+}
+
+/* row of rank r, an empty one added if it had no node when built */
+static int bitmaps_row(struct fpt_bitmaps *b, int r)
+{
+	size_t k = b->nr;
+
+	if (b->row[r] >= 0)
+		return b->row[r];
+	b->bits = realloc(b->bits, (k + 1) * b->nw * sizeof(b->bits[0]));
+	b->lo = realloc(b->lo, (k + 1) * sizeof(b->lo[0]));
+	b->hi = realloc(b->hi, (k + 1) * sizeof(b->hi[0]));
+	b->cnt = realloc(b->cnt, (k + 1) * sizeof(b->cnt[0]));
+	if (!b->bits)
+		die("Not enough memory for %lu bitmaps", k + 1);
+	memset(b->bits + k * b->nw, 0, b->nw * sizeof(b->bits[0]));
+	b->lo[k] = b->hi[k] = b->nw;
+	b->cnt[k] = 0;
+	b->nr++;
+	return b->row[r] = k;
+}
+
+/**
+ * Add w copies (remove -w) of the transaction of the l ranks in ks, ending
+ * in node y, to the bitmaps. Added ones take the next spare bits, removed
+ * ones clear the bits of copies ending in y. Returns 0, changing nothing,
+ * if there are not enough spare bits left.
+ */
+static int bitmaps_update(struct fpt_bitmaps *b, const int *ks, int l,
+		uint32_t y, int w)
+{
+	size_t pos;
+	int i, k;
+
+	/* with no item in the tree, it is only counted in fp->t */
+	if (!y)
+		return 1;
+	if (w > 0) {
+		if (b->nb + w > b->nw * 64)
+			return 0;
+		for (i = 0; i < l; i++) {
+			k = bitmaps_row(b, ks[i]);
+			bits_set(b->bits + k * b->nw, b->nb, b->nb + w);
+			b->cnt[k] += w;
+			b->lo[k] = min(b->lo[k], b->nb / 64);
+			b->hi[k] = max(b->hi[k], (b->nb + w + 63) / 64);
+		}
+		for (; w > 0; w--) {
+			b->link[b->nb - b->nb0] = b->more[y];
+			b->more[y] = ++b->nb;
+		}
+		return 1;
+	}
+
+	for (; w < 0; w++) {
+		if (b->more[y]) {
+			pos = b->more[y] - 1;
+			b->more[y] = b->link[pos - b->nb0];
+		} else
+			pos = b->home[y] + --b->left[y];
+		for (i = 0; i < l; i++) {
+			k = b->row[ks[i]];
+			b->bits[k * b->nw + pos / 64] &= ~(1ULL << pos % 64);
+			b->cnt[k]--;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Give the nodes of the snapshot their new counts and add the new ones at
+ * its end. Returns 0 if too many are added or emptied to keep it.
+ */
+static int snapshot_update(struct fptree *fp)
+{
+	struct fpt_updates *u = fp->up;
+	struct fpt_snapshot *s = fp->tree;
+	uint32_t x, y, n0 = s->nn;
+	size_t i;
+
+	u->ix = realloc(u->ix, u->a.n * sizeof(u->ix[0]));
+	memset(u->ix + u->nix, 0, (u->a.n - u->nix) * sizeof(u->ix[0]));
+	for (i = 0; i < u->nt; i++) {
+		x = u->touched[i];
+		/* left out of the last freeze, emptied before */
+		if (!(y = u->ix[x])) {
+			if (u->a.nodes[x].cnt)
+				snapshot_add(fp, x);
+			continue;
+		}
+		if (!s->cnt[y] != !u->a.nodes[x].cnt)
+			u->dead += s->cnt[y] ? 1 : -1;
+		s->cnt[y] = u->a.nodes[x].cnt;
+	}
+	for (x = u->nix; x < u->a.n; x++)
+		if (u->a.nodes[x].cnt)
+			snapshot_add(fp, x);
+	u->nix = u->a.n;
+	if (s->nn > n0)
+		chains_add(fp, n0);
+
+	return s->added + u->dead <= FPT_SLACK * s->nn;
+}
+
+/* replay the log on the bitmaps, 0 if they have no room left for it */
+static int bitmaps_replay(struct fptree *fp)
+{
+	struct fpt_updates *u = fp->up;
+	int *ks, k, l, len, ok = 1;
+	size_t i;
+
+	bitmaps_grow(fp->bm, fp->tree->nn);
+	ks = calloc(fp->n + 1, sizeof(ks[0]));
+	for (i = 0; i < u->nlog && ok; i += 3 + len) {
+		len = u->log[i + 1];
+		for (k = 0, l = 0; k < len; k++)
+			if (fp->table[u->log[i + 3 + k]].kept)
+				ks[l++] = u->log[i + 3 + k];
+		ok = bitmaps_update(fp->bm, ks, l,
+				u->ix[(uint32_t)u->log[i + 2]], u->log[i]);
+	}
+	free(ks);
+	return ok;
+}
+
+void fpt_refresh(struct fptree *fp)
+{
+	struct fpt_updates *u = fp->up;
+	size_t i, r, out, occ;
+	int k, w, len;
+
+	if (!u || !u->nlog)
+		return;
+
+	for (i = 0; i < u->nlog; i += 3 + len) {
+		w = u->log[i];
+		len = u->log[i + 1];
+		fp->t += w;
+		for (k = 0; k < len; k++)
+			fp->table[u->log[i + 3 + k]].cnt += w;
+		if (fp->pairs)
+			pairs_add(fp->pairs, u->log + i + 3, len, w);
+	}
+
+	/* rank the items again once they are too far out of order */
+	for (r = 1, out = 0, occ = fp->n ? fp->table[0].cnt : 0; r < fp->n; r++) {
+		occ += fp->table[r].cnt;
+		if (fp->table[r - 1].cnt < fp->table[r].cnt)
+			out += fp->table[r].cnt - fp->table[r - 1].cnt;
+	}
+	if (out > FPT_DRIFT * occ) {
+		rebalance(fp);
+		refreeze(fp);
+	} else if (!snapshot_update(fp))
+		refreeze(fp);
+	else if (!fp->bm || bitmaps_replay(fp))
+		goto done;
+
+	/* the nodes moved, or the bitmaps are full */
+	if (fp->bm)
+		bitmaps_rebuild(fp);
+done:
+	u->nlog = 0;
+	u->nt = 0;
+}
+
+int fpt_height(const struct fptree *fp)
+{
+	return fp->parts ? fp->parts->height : fp->tree->height;
+}
+
+int fpt_nodes(const struct fptree *fp)
+{
+	return fp->parts ? fp->parts->nn : fp->tree->nn;
+}
+
+/* depths with a line of their own in the fan-out profile */
+#ifndef PROFILE_DEPTHS
+#define PROFILE_DEPTHS 16
+#endif
+
+static inline double mib(size_t b)
+{
+	return (double)b / (1 << 20);
+}
+
+/* chain lengths: quantiles and a histogram in powers of 2 */
+static void profile_chains(const uint32_t *len, size_t nr)
+{
+	size_t i, k, lo, h[33] = { 0 };
+	uint32_t *srt = calloc(nr + 1, sizeof(srt[0]));
+
+	memcpy(srt, len, nr * sizeof(srt[0]));
+	qsort(srt, nr, sizeof(srt[0]), uint32_cmp);
+	printf("Chains: %lu items, length min %u, median %u, p90 %u, p99 %u, max %u\n",
+			nr, srt[0], srt[nr / 2], srt[nr * 9 / 10],
+			srt[nr * 99 / 100], srt[nr - 1]);
+	for (i = 0; i < nr; i++) {
+		for (k = 0; srt[i] >> (k + 1); k++);
+		h[k]++;
+	}
+	for (k = 0; k < 33; k++)
+		if (h[k]) {
+			lo = (size_t)1 << k;
+			printf("  length %8lu .. %8lu: %8lu items\n", lo,
+					2 * lo - 1, h[k]);
+		}
+	free(srt);
+}
+
+/* children of the nodes at each depth, the deepest ones together */
+static void profile_fanout(const struct fpt_snapshot *s)
+{
+	size_t nd = min((size_t)s->height, (size_t)PROFILE_DEPTHS + 1), d;
+	size_t *nodes = calloc(nd, sizeof(nodes[0]));
+	size_t *leaves = calloc(nd, sizeof(leaves[0]));
+	size_t *kids = calloc(nd, sizeof(kids[0]));
+	uint32_t *fan = calloc(nd, sizeof(fan[0]));
+	uint32_t *nc = calloc(s->nn, sizeof(nc[0]));
+	uint32_t x;
+
+	for (x = 1; x < s->nn; x++)
+		nc[s->parent[x]]++;
+	for (x = 0; x < s->nn; x++) {
+		d = min((size_t)s->depth[x], nd - 1);
+		nodes[d]++;
+		kids[d] += nc[x];
+		leaves[d] += !nc[x];
+		fan[d] = max(fan[d], nc[x]);
+	}
+
+	printf("Fan-out: depth, nodes, leaves, mean and max children\n");
+	for (d = 0; d < nd; d++)
+		printf("  %s%-4lu %10lu %10lu %10.2lf %8u\n",
+				d == PROFILE_DEPTHS ? ">=" : "  ", d,
+				nodes[d], leaves[d],
+				div_or_zero(kids[d], nodes[d]), fan[d]);
+
+	free(nodes);
+	free(leaves);
+	free(kids);
+	free(fan);
+	free(nc);
+}
+
+size_t fpt_profile(const struct fptree *fp, size_t ni)
+{
+	const struct fpt_snapshot *s = fp->tree;
+	const struct fpt_bitmaps *b = fp->bm;
+	size_t r, nr = 0, nt = 0, ntop = 0, occ = 0, walk = 0, wtop = 0;
+	size_t tree, table, ids, bm = 0, pairs = 0, up = 0;
+	double wocc = 0;
+	uint32_t *len;
+
+	printf("Profile of the fp-tree:\n");
+	if (fp->parts) {
+		printf("Partitioned in %lu partitions of %u nodes in all, mapped when queried\n",
+				fp->parts->np, fp->parts->nn);
+		return fp->n * (sizeof(fp->table[0]) + sizeof(fp->ids[0]));
+	}
+
+	/* chain walked by a query of each last rank */
+	len = calloc(fp->n + 1, sizeof(len[0]));
+	for (r = 0; r < fp->n; r++) {
+		if (s->cstart[r + 1] == s->cstart[r])
+			continue;
+		len[nr] = s->cstart[r + 1] - s->cstart[r];
+		walk += len[nr];
+		wocc += (double)len[nr] * fp->table[r].cnt;
+		occ += fp->table[r].cnt;
+		if (r < ni) {
+			wtop += len[nr];
+			ntop++;
+		}
+		nr++;
+	}
+	if (nr)
+		profile_chains(len, nr);
+	printf("Chain walk per query item: %.1lf nodes, %.1lf weighted by count, %.1lf in the first %lu ranks\n",
+			div_or_zero(walk, nr), div_or_zero(wocc, occ),
+			div_or_zero(wtop, ntop), min(ni, fp->n));
+	if (b) {
+		for (r = 0, walk = 0; r < fp->n; r++)
+			if (b->row[r] >= 0) {
+				walk += b->hi[b->row[r]] - b->lo[b->row[r]];
+				nt++;
+			}
+		printf("Bitmap words per query item: %.1lf of %lu\n",
+				div_or_zero(walk, nt), b->nw);
+	}
+	free(len);
+	profile_fanout(s);
+
+	tree = s->nn * (sizeof(s->rank[0]) + sizeof(s->cnt[0]) +
+			sizeof(s->parent[0]) + sizeof(s->depth[0]) +
+			sizeof(s->chain[0]) + sizeof(s->anc[0]) +
+			sizeof(s->jump[0]) + sizeof(s->end[0])) +
+		(fp->n + 1) * sizeof(s->cstart[0]);
+	table = fp->n * sizeof(fp->table[0]);
+	ids = fp->n * sizeof(fp->ids[0]);
+	if (b)
+		bm = fp->n * sizeof(b->row[0]) + nt * (b->nw * sizeof(b->bits[0]) +
+				sizeof(b->lo[0]) + sizeof(b->hi[0]) +
+				sizeof(b->cnt[0]));
+	if (fp->pairs)
+		pairs = (fp->n + 1) * sizeof(fp->pairs->pix[0]) +
+			fp->pairs->n * (fp->pairs->n + 1) / 2 *
+			sizeof(fp->pairs->m[0]);
+	if (fp->up)
+		up = fp->up->a.sz * sizeof(fp->up->a.nodes[0]) +
+			fp->up->ci.hsz * (sizeof(fp->up->ci.keys[0]) +
+					sizeof(fp->up->ci.vals[0])) +
+			fp->up->nix * sizeof(fp->up->ix[0]) +
+			fp->up->szt * sizeof(fp->up->touched[0]) +
+			fp->up->szlog * sizeof(fp->up->log[0]);
+	printf("Memory: tree %.1lf MiB (%.1lf bytes/node%s), table %.1lf MiB, ids %.1lf MiB, bitmaps %.1lf MiB, pairs %.1lf MiB, updates %.1lf MiB\n",
+			mib(tree), div_or_zero(tree, s->nn),
+			s->map ? ", mapped" : "", mib(table), mib(ids),
+			mib(bm), mib(pairs), mib(up));
+	return tree + table + ids + bm + pairs + up;
+}
+
+#undef PROFILE_DEPTHS
+
+/* tree holding the counts of the itemsets of last rank r */
+static inline const struct fpt_snapshot *tree_of(const struct fptree *fp,
+		int r)
+{
+	return fp->parts ? part_load(fp->parts, r) : fp->tree;
+}
+
+size_t fpt_item_id(const struct fptree *fp, int it)
+{
+	if (it < 1 || (size_t)it > fp->n)
+		return 0;
+	return fp->ids[it - 1];
+}
+
+int fpt_id_item(const struct fptree *fp, size_t id)
+{
+	size_t lo = 0, hi = fp->up ? fp->up->n0 : fp->n, m;
+	const int *a;
+
+	while (lo < hi) {
+		m = lo + (hi - lo) / 2;
+		if (fp->ids[m] < id)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	if (lo < (fp->up ? fp->up->n0 : fp->n) && fp->ids[lo] == id)
+		return lo + 1;
+	if (!fp->up)
+		return 0;
+
+	/* then the ones added by updates */
+	a = fp->up->added;
+	for (lo = 0, hi = fp->n - fp->up->n0; lo < hi; ) {
+		m = lo + (hi - lo) / 2;
+		if (fp->ids[a[m] - 1] < id)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	return lo < fp->n - fp->up->n0 && fp->ids[a[lo] - 1] == id ? a[lo] : 0;
+}
+
+int fpt_item_count(const struct fptree *fp, int it)
+{
+	if (it < 0 || (size_t)it >= fp->n)
+		return 0;
+	return fp->table[fp->table[it].rpi].cnt;
+}
+
+/**
+ * Count of node n if the items of key (ranks, increasing) are all on its
+ * path, the last one being n itself. Ranks decrease towards the root.
+ *
+ * The first m items of key rank below ANC_BITS and are checked at once
+ * against the ancestor bitset of n, the others are searched for on the
+ * path, jumping over the ancestors ranked after them.
+ */
+static int search_on_path(const struct fpt_snapshot *s, uint32_t n,
+		const int *key, int keylen, uint64_t mask, int m)
+{
+	int i = keylen - 2;
+	uint32_t p = s->parent[n];
+
+	if ((s->anc[n] & mask) != mask)
+		return 0;
+
+	for (; i >= m; i--, p = s->parent[p]) {
+		/* not enough levels left */
+		if (s->depth[p] < (uint32_t)i + 1)
+			return 0;
+		/* first ancestor not ranked after key[i] */
+		while (s->rank[p] > key[i])
+			p = s->rank[s->jump[p]] > key[i] ? s->jump[p] : s->parent[p];
+		if (s->rank[p] != key[i])
+			return 0;
+	}
+
+	return s->cnt[n];
+}
+
+int fpt_item_rank(const struct fptree *fp, int it)
+{
+	return fp->table[it - 1].rpi;
+}
+
+int fpt_rank_item(const struct fptree *fp, int r)
+{
+	return fp->table[r].val;
+}
+
+int fpt_rank_count(const struct fptree *fp, int r)
+{
+	return fp->table[r].cnt;
+}
+
+/* words of the bitmaps ANDed at once */
+#ifndef BITMAP_BLOCK
+#define BITMAP_BLOCK 256
+#endif
+
+/**
+ * Count of the ranks rs with the bitmaps, only over the words non zero in
+ * all their rows, a block of BITMAP_BLOCK words at a time.
+ */
+static int bitmap_count(const struct fpt_bitmaps *b, const int *rs, int len)
+{
+	size_t w, n, lo = 0, hi = b->nw;
+	uint64_t a[BITMAP_BLOCK];
+	const uint64_t *r0;
+	int i, count = 0;
+
+	for (i = 0; i < len; i++) {
+		if (b->row[rs[i]] < 0)
+			return 0;
+		lo = max(lo, b->lo[b->row[rs[i]]]);
+		hi = min(hi, b->hi[b->row[rs[i]]]);
+	}
+
+	r0 = b->bits + b->row[rs[0]] * b->nw;
+	if (len == 1)
+		return lo < hi ? words_count(r0 + lo, hi - lo) : 0;
+	for (w = lo; w < hi; w += n) {
+		n = min(hi - w, (size_t)BITMAP_BLOCK);
+		memcpy(a, b->bits + b->row[rs[len - 1]] * b->nw + w,
+				n * sizeof(a[0]));
+		for (i = len - 2; i > 0; i--)
+			words_and(a, b->bits + b->row[rs[i]] * b->nw + w, n);
+		count += words_and_count(a, r0 + w, n);
+	}
+	return count;
+}
+
+/* ranks of an itemset looked up in the pair matrix, at most */
+#define PAIRS_CHECK 16
+
+/**
+ * Count of the itemset of the len ranks in rs and r from the pair matrix:
+ * exact for one or two ranks in it, 0 if two of its ranks in it are never
+ * seen together, -1 if unknown.
+ */
+static inline int pair_at(const struct fpt_pairs *pm, int a, int b)
+{
+	return a < b ? pm->m[(size_t)b * (b + 1) / 2 + a] :
+		pm->m[(size_t)a * (a + 1) / 2 + b];
+}
+
+static int pairs_count(const struct fpt_pairs *pm, const int *rs, int len,
+		int r)
+{
+	int ix[PAIRS_CHECK], n = 0, i, j;
+
+	if (!pm)
+		return -1;
+	for (i = 0; i <= len && n < PAIRS_CHECK; i++)
+		if ((j = pm->pix[i < len ? rs[i] : r]) >= 0)
+			ix[n++] = j;
+
+	if (n == len + 1 && n <= 2)
+		return pair_at(pm, ix[0], ix[n - 1]);
+	for (i = 1; i < n; i++)
+		for (j = 0; j < i; j++)
+			if (!pair_at(pm, ix[j], ix[i]))
+				return 0;
+	return -1;
+}
+
+#undef PAIRS_CHECK
+
+int fpt_rankset_count(const struct fptree *fp, const int *rs, int len)
+{
+	const struct fpt_snapshot *s;
+	int m, r = rs[len - 1], count;
+	uint64_t mask = 0;
+	uint32_t j;
+
+	if ((count = pairs_count(fp->pairs, rs, len - 1, r)) >= 0)
+		return count;
+	count = 0;
+	if (fp->bm)
+		return bitmap_count(fp->bm, rs, len);
+
+	for (m = 0; m < len && rs[m] < ANC_BITS; m++)
+		mask |= 1ULL << rs[m];
+
+	s = tree_of(fp, r);
+	for (j = s->cstart[r]; j < s->cstart[r + 1]; j++)
+		count += search_on_path(s, s->chain[j], rs, len, mask, m);
+	return count;
+}
+
+/**
+ * A query of a batch: the rank of its chain and whether the ancestor
+ * bitsets answer it alone (all but its last rank below ANC_BITS).
+ */
+struct batch_query {
+	int r;
+	int exact;
+	size_t i;
+};
+
+static int batch_query_cmp(const void *a, const void *b)
+{
+	const struct batch_query *qa = a, *qb = b;
+
+	if (qa->r != qb->r)
+		return qa->r - qb->r;
+	if (qa->exact != qb->exact)
+		return qb->exact - qa->exact;
+	return qa->i < qb->i ? -1 : qa->i > qb->i;
+}
+
+void fpt_ranksets_count(const struct fptree *fp, const int *const *rs,
+		const int *len, size_t n, int *counts)
+{
+	struct batch_query *bq;
+	const struct fpt_snapshot *s;
+	size_t i, q, g, e, nq;
+	uint64_t *mask, a;
+	int *m, *acc, c;
+	uint32_t j, x;
+
+	if (fp->bm) {
+		for (i = 0; i < n; i++)
+			counts[i] = fpt_rankset_count(fp, rs[i], len[i]);
+		return;
+	}
+
+	bq = calloc(n + 1, sizeof(bq[0]));
+	mask = calloc(n + 1, sizeof(mask[0]));
+	m = calloc(n + 1, sizeof(m[0]));
+	acc = calloc(n + 1, sizeof(acc[0]));
+	/* only the queries the pair matrix does not answer */
+	for (i = 0, nq = 0; i < n; i++) {
+		counts[i] = pairs_count(fp->pairs, rs[i], len[i] - 1,
+				rs[i][len[i] - 1]);
+		if (counts[i] >= 0)
+			continue;
+		bq[nq].r = rs[i][len[i] - 1];
+		bq[nq].i = i;
+		for (c = 0; c < len[i] - 1 && rs[i][c] < ANC_BITS; c++);
+		bq[nq++].exact = c == len[i] - 1;
+	}
+	n = nq;
+	qsort(bq, n, sizeof(bq[0]), batch_query_cmp);
+
+	/* masks in batch order, so a group reads them in sequence */
+	for (q = 0; q < n; q++) {
+		i = bq[q].i;
+		for (; m[q] < len[i] && rs[i][m[q]] < ANC_BITS; m[q]++)
+			mask[q] |= 1ULL << rs[i][m[q]];
+	}
+
+	/* one pass over the chain for each group of queries */
+	for (g = 0; g < n; g = e) {
+		for (e = g + 1; e < n && bq[e].r == bq[g].r &&
+				bq[e].exact == bq[g].exact; e++);
+		s = tree_of(fp, bq[g].r);
+		for (j = s->cstart[bq[g].r]; j < s->cstart[bq[g].r + 1]; j++) {
+			x = s->chain[j];
+			a = s->anc[x];
+			c = s->cnt[x];
+			if (bq[g].exact)
+				for (q = g; q < e; q++)
+					acc[q] += (a & mask[q]) == mask[q] ? c : 0;
+			else
+				for (q = g; q < e; q++)
+					acc[q] += search_on_path(s, x, rs[bq[q].i],
+							len[bq[q].i], mask[q], m[q]);
+		}
+	}
+
+	for (q = 0; q < n; q++)
+		counts[bq[q].i] = acc[q];
+
+	free(bq);
+	free(mask);
+	free(m);
+	free(acc);
+}
+
+/**
+ * Lattice of rs with the bitmaps: for each word, the transactions of every
+ * subset are those of the subset without its last rank and that rank.
+ */
+static void lattice_bitmap_count(const struct fpt_bitmaps *b, const int *rs,
+		int len, int *counts)
+{
+	size_t w, k, lo = b->nw, hi = 0, h = (size_t)1 << len;
+	uint64_t *a = calloc(h, sizeof(a[0])), x;
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (b->row[rs[i]] >= 0) {
+			lo = min(lo, b->lo[b->row[rs[i]]]);
+			hi = max(hi, b->hi[b->row[rs[i]]]);
+		}
+
+	for (w = lo; w < hi; w++) {
+		a[0] = ~0ULL;
+		for (i = 0; i < len; i++) {
+			x = b->row[rs[i]] < 0 ? 0 :
+				b->bits[b->row[rs[i]] * b->nw + w];
+			words_and_word(a + ((size_t)1 << i), a, x,
+					(size_t)1 << i);
+		}
+		for (k = 1; k < h; k++)
+			counts[k] += __builtin_popcountll(a[k]);
+	}
+	free(a);
+}
+
+/**
+ * Lattice of rs with the tree: the subsets whose last rank is rs[i] are
+ * counted in one pass over its chain, each node adding its count to the
+ * subset of the ranks before on its path. Each subset then gets the counts
+ * of its supersets.
+ */
+static void lattice_tree_count(const struct fptree *fp, const int *rs,
+		int len, int *counts)
+{
+	const struct fpt_snapshot *s;
+	size_t k, m, h;
+	uint32_t j, x, p;
+	int i, l, *f;
+
+	for (i = 0; i < len; i++) {
+		/* the subsets with rs[i] last, by the bits of the ranks before */
+		h = (size_t)1 << i;
+		f = counts + h;
+		s = tree_of(fp, rs[i]);
+		for (j = s->cstart[rs[i]]; j < s->cstart[rs[i] + 1]; j++) {
+			x = s->chain[j];
+			p = s->parent[x];
+			/* ranks decrease towards the root, as l does */
+			for (l = i - 1, m = 0; l >= 0; l--) {
+				if (rs[l] < ANC_BITS) {
+					m |= (size_t)(s->anc[x] >> rs[l] & 1) << l;
+					continue;
+				}
+				while (s->rank[p] > rs[l])
+					p = s->rank[s->jump[p]] > rs[l] ?
+						s->jump[p] : s->parent[p];
+				if (s->rank[p] == rs[l])
+					m |= (size_t)1 << l;
+			}
+			f[m] += s->cnt[x];
+		}
+		for (l = 0; l < i; l++)
+			for (k = 0; k < h; k++)
+				if (!(k >> l & 1))
+					f[k] += f[k | (size_t)1 << l];
+	}
+}
+
+void fpt_lattice_count(const struct fptree *fp, const int *rs, int len,
+		int *counts)
+{
+	memset(counts, 0, ((size_t)1 << len) * sizeof(counts[0]));
+	if (fp->bm)
+		lattice_bitmap_count(fp->bm, rs, len, counts);
+	else
+		lattice_tree_count(fp, rs, len, counts);
+	counts[0] = fp->t;
+}
+
+/* the n sorted ranks of base and x, sorted in srt */
+static inline void insert_rank(const int *base, int n, int x, int *srt)
+{
+	for (; n > 0 && base[n - 1] > x; n--)
+		srt[n] = base[n - 1];
+	srt[n] = x;
+	for (; n > 0; n--)
+		srt[n - 1] = base[n - 1];
+}
+
+/* whether rank r, below the rank of node n, is on its path */
+static int on_path(const struct fpt_snapshot *s, uint32_t n, int r)
+{
+	uint32_t p = s->parent[n];
+
+	if (r < ANC_BITS)
+		return s->anc[n] >> r & 1;
+	while (s->rank[p] > r)
+		p = s->rank[s->jump[p]] > r ? s->jump[p] : s->parent[p];
+	return s->rank[p] == r;
+}
+
+/* add node x to the projection of np, dropping it if it grows too large */
+static int project_node(struct fpt_prefix *np, size_t *sz, uint32_t x)
+{
+	if (np->no == PREFIX_MAX_NODES) {
+		free(np->occ);
+		np->occ = NULL;
+		return 0;
+	}
+	if (np->no == *sz) {
+		*sz = 2 * *sz + 16;
+		np->occ = realloc(np->occ, *sz * sizeof(np->occ[0]));
+	}
+	np->occ[np->no++] = x;
+	return 1;
+}
+
+/**
+ * Project np, p extended with r, on the tree: its extensions are on the
+ * paths to the nodes found and in their subtrees, fewer at each level.
+ * From the projection of p, extending it with a rank below its last one
+ * keeps its nodes with r on their path; with a rank after it, the nodes of
+ * rank r in their subtrees take their place.
+ */
+static void prefix_project(const struct fpt_snapshot *s,
+		const struct fpt_prefix *p, struct fpt_prefix *np, int r)
+{
+	int m, last = np->rs[np->len - 1];
+	uint32_t j, k, x, y;
+	uint64_t mask = 0;
+	size_t i, sz = 0;
+
+	/* nodes added by updates are out of DFS order until frozen again */
+	if (s->added)
+		return;
+
+	if (p && p->occ && r < p->rs[p->len - 1]) {
+		np->occ = calloc(p->no + 1, sizeof(np->occ[0]));
+		for (i = 0; i < p->no; i++)
+			if (on_path(s, p->occ[i], r))
+				np->occ[np->no++] = p->occ[i];
+		return;
+	}
+
+	np->occ = calloc(1, sizeof(np->occ[0]));
+	if (p && p->occ) {
+		for (i = 0; i < p->no; i++) {
+			x = p->occ[i];
+			/* first node of the chain after x */
+			for (j = s->cstart[r], k = s->cstart[r + 1]; j < k; ) {
+				y = j + (k - j) / 2;
+				if (s->chain[y] > x)
+					k = y;
+				else
+					j = y + 1;
+			}
+			for (; j < s->cstart[r + 1] && s->chain[j] < s->end[x]; j++)
+				if (!project_node(np, &sz, s->chain[j]))
+					return;
+		}
+	} else {
+		for (m = 0; m < np->len && np->rs[m] < ANC_BITS; m++)
+			mask |= 1ULL << np->rs[m];
+		for (j = s->cstart[last]; j < s->cstart[last + 1]; j++)
+			if (search_on_path(s, s->chain[j], np->rs, np->len, mask, m) &&
+					!project_node(np, &sz, s->chain[j]))
+				return;
+	}
+}
+
+struct fpt_prefix *fpt_prefix_new(const struct fptree *fp,
+		const struct fpt_prefix *p, int r)
+{
+	struct fpt_prefix *np = calloc(1, sizeof(*np));
+	const struct fpt_bitmaps *b = fp->bm;
+	const uint64_t *row;
+	size_t k, sz;
+
+	np->len = p ? p->len + 1 : 1;
+	np->rs = calloc(np->len, sizeof(np->rs[0]));
+	insert_rank(p ? p->rs : NULL, np->len - 1, r, np->rs);
+	if (!b) {
+		/* a partitioned tree has no single tree to project on */
+		if (!fp->parts)
+			prefix_project(fp->tree, p, np, r);
+		return np;
+	}
+	if (b->row[r] < 0)
+		return np;
+
+	/* the AND of the row, then only its non zero words, fewer each level */
+	row = b->bits + b->row[r] * b->nw;
+	sz = p ? p->nz : b->hi[b->row[r]] - b->lo[b->row[r]];
+	np->bits = calloc(sz + 1, sizeof(np->bits[0]));
+	np->word = calloc(sz + 1, sizeof(np->word[0]));
 	if (p)
-		count += search_on_path(p, search_key, key_len);
+		words_and_gather(np->bits, p->bits, row, p->word, sz);
+	else
+		memcpy(np->bits, row + b->lo[b->row[r]],
+				sz * sizeof(np->bits[0]));
+	for (k = 0; k < sz; k++) {
+		if (!np->bits[k])
+			continue;
+		np->bits[np->nz] = np->bits[k];
+		np->word[np->nz++] = p ? p->word[k] : b->lo[b->row[r]] + k;
+	}
+	return np;
+}
+
+void fpt_prefix_free(struct fpt_prefix *p)
+{
+	free(p->rs);
+	free(p->bits);
+	free(p->word);
+	free(p->occ);
+	free(p);
+}
+
+/* count of prefix p (not empty) and rank r with the bitmaps */
+static int prefix_bitmap_count(const struct fpt_bitmaps *b,
+		const struct fpt_prefix *p, int r)
+{
+	uint64_t a[BITMAP_BLOCK];
+	int count = 0;
+	size_t k, n;
+
+	if (b->row[r] < 0)
+		return 0;
+	/* gathered a block at a time, to count the AND in one loop */
+	for (k = 0; k < p->nz; k += n) {
+		n = min(p->nz - k, (size_t)BITMAP_BLOCK);
+		words_and_gather(a, p->bits + k, b->bits + b->row[r] * b->nw,
+				p->word + k, n);
+		count += words_count(a, n);
+	}
+	return count;
+}
+
+/**
+ * Counts of the extensions of p with the tree projection: an extension
+ * ranked below the last rank of p is on the path to its nodes, one ranked
+ * after it in their subtrees. Each node is visited once for all of them.
+ */
+static void prefix_tree_count(const struct fptree *fp,
+		const struct fpt_prefix *p, const int *rs, size_t n, int *counts)
+{
+	const struct fpt_snapshot *s = fp->tree;
+	int lo = fp->n, hi = -1, *pos, w;
+	uint32_t x, y;
+	size_t i;
+
+	/* only the queries the pair matrix does not answer, left at -1 */
+	for (i = 0; i < n; i++) {
+		counts[i] = pairs_count(fp->pairs, p->rs, p->len, rs[i]);
+		if (counts[i] >= 0)
+			continue;
+		lo = min(lo, rs[i]);
+		hi = max(hi, rs[i]);
+	}
+	if (hi < 0)
+		return;
+
+	/* query of each rank from lo to hi, -1 for none */
+	pos = calloc(hi - lo + 1, sizeof(pos[0]));
+	memset(pos, 0xff, (hi - lo + 1) * sizeof(pos[0]));
+	for (i = 0; i < n; i++)
+		if (counts[i] < 0) {
+			pos[rs[i] - lo] = i;
+			counts[i] = 0;
+		}
+
+	for (i = 0; i < p->no; i++) {
+		x = p->occ[i];
+		w = s->cnt[x];
+		/* ranks decrease towards the root */
+		for (y = s->parent[x]; y && s->rank[y] >= lo; y = s->parent[y])
+			if (s->rank[y] <= hi && pos[s->rank[y] - lo] >= 0)
+				counts[pos[s->rank[y] - lo]] += w;
+		for (y = x + 1; y < s->end[x]; y++)
+			if (s->rank[y] >= lo && s->rank[y] <= hi &&
+					pos[s->rank[y] - lo] >= 0)
+				counts[pos[s->rank[y] - lo]] += s->cnt[y];
+	}
+	free(pos);
+}
+
+void fpt_prefix_count(const struct fptree *fp, const struct fpt_prefix *p,
+		const int *rs, size_t n, int *counts)
+{
+	const struct fpt_bitmaps *b = fp->bm;
+	int len = p ? p->len + 1 : 1, *sets, *lens;
+	const int **qs;
+	size_t i;
+
+	if (b) {
+		for (i = 0; i < n; i++) {
+			counts[i] = pairs_count(fp->pairs, p ? p->rs : NULL,
+					len - 1, rs[i]);
+			if (counts[i] >= 0)
+				continue;
+			if (p)
+				counts[i] = prefix_bitmap_count(b, p, rs[i]);
+			else
+				counts[i] = b->row[rs[i]] < 0 ? 0 :
+					b->cnt[b->row[rs[i]]];
+		}
+		return;
+	}
+	if (p && p->occ) {
+		prefix_tree_count(fp, p, rs, n, counts);
+		return;
+	}
+
+	sets = calloc(n * len + 1, sizeof(sets[0]));
+	qs = calloc(n + 1, sizeof(qs[0]));
+	lens = calloc(n + 1, sizeof(lens[0]));
+	for (i = 0; i < n; i++) {
+		insert_rank(p ? p->rs : NULL, len - 1, rs[i], sets + i * len);
+		qs[i] = sets + i * len;
+		lens[i] = len;
+	}
+	fpt_ranksets_count(fp, qs, lens, n, counts);
+
+	free(sets);
+	free(qs);
+	free(lens);
+}
+
+int fpt_itemset_count(const struct fptree *fp, const int *its, int itslen)
+{
+	int *search_key = calloc(itslen, sizeof(search_key[0]));
+	int i, count, key_len = 0;
+
+	for (i = 0; i < itslen; i++)
+		if (its[i] > 0)
+			search_key[key_len++] = fp->table[its[i] - 1].rpi;
+	qsort(search_key, key_len, sizeof(search_key[0]), int_cmp);
+
+	/* an item given twice is never found twice on a path */
+	for (i = 1; i < key_len; i++)
+		if (search_key[i] == search_key[i - 1])
+			break;
+	count = i < key_len ? 0 : fpt_rankset_count(fp, search_key, key_len);
 
 	free(search_key);
 	return count;
@@ -5,7 +5,12 @@
 #define _FP_H
 
 struct table;
-struct fptree_node;
+struct fpt_snapshot;
+struct fpt_bitmaps;
+struct fpt_prefix;
+struct fpt_pairs;
+struct fpt_updates;
+struct fpt_parts;
 
 /**
  * A fp-tree structure.
@@ -13,20 +18,145 @@ struct fptree_node;
  * Contains all the information needed to reconstruct a transaction file.
  */
 struct fptree {
-	/* number of items */
+	/* number of distinct items, numbered from 1 to n in the tree */
 	size_t n;
-	/* number of transactions */
+	/* number of transactions, in the sample if sampled */
 	size_t t;
+	/* fraction of the transactions sampled, 1 for all */
+	double q;
 	/* header table for the tree, opaque */
 	struct table *table;
-	/* root of the tree, opaque */
-	struct fptree_node *tree;
+	/* the tree, read only once built, opaque */
+	struct fpt_snapshot *tree;
+	/* vertical bitmaps, only with the bitmap backend, opaque */
+	struct fpt_bitmaps *bm;
+	/* counts of the pairs of the most frequent items, if asked, opaque */
+	struct fpt_pairs *pairs;
+	/* state kept for fpt_update, if asked, opaque */
+	struct fpt_updates *up;
+	/* partitions on disk in place of tree, if asked, opaque */
+	struct fpt_parts *parts;
+	/**
+	 * Id in the transaction file of each item, in increasing order for the
+	 * items loaded. The ones added by fpt_update_ids come after them.
+	 */
+	size_t *ids;
+};
+
+/**
+ * Backends answering the count queries: the fp-tree itself, or one bitmap
+ * of transactions per item, much faster on dense data but larger. FPT_AUTO
+ * picks one from the density of the data once it is loaded.
+ */
+enum fpt_backend {
+	FPT_AUTO,
+	FPT_TREE,
+	FPT_BITMAP,
+};
+
+/**
+ * Options for reading a transaction file.
+ */
+struct fpt_options {
+	/* number of threads used to parse the file and build the tree */
+	size_t threads;
+	/**
+	 * Optional projection, called once the item counts are known and
+	 * before the tree is built. It stores in keep the (1-based) items to
+	 * be kept in the tree and returns their number, at most fp->n. The
+	 * other items are dropped from every transaction: their counts are
+	 * still reported by fpt_item_count but any itemset containing them
+	 * has a count of 0 in the tree.
+	 */
+	size_t (*select)(const struct fptree *fp, int *keep, void *arg);
+	void *select_arg;
+	/* backend for the count queries */
+	enum fpt_backend backend;
+	/**
+	 * Number of most frequent items in the tree whose pair counts are
+	 * computed once loaded (0 for none), bounded by PAIRS_MAX_MB. Counts
+	 * of one or two of them are then immediate and itemsets with two of
+	 * them never seen together are counted as 0 without a search.
+	 */
+	size_t pairs;
+	/* keep what fpt_update needs, about as much memory as the tree */
+	int updatable;
+	/**
+	 * Directory of tree images, NULL for none. A tree is mapped from the
+	 * image of its input file if there is one, shared with the other runs
+	 * mapping it, and saved there after being built otherwise. Not used
+	 * with select, updatable or sample. Images are found by the size,
+	 * inode and time of modification of the input; with image_verify,
+	 * the hash of its whole content must match too, which reads it all.
+	 */
+	const char *image_dir;
+	int image_verify;
+	/**
+	 * Directory for a partitioned tree, NULL for none: for inputs larger
+	 * than memory, the tree is split by ranks in partitions written there
+	 * and mapped by the count queries only when needed, within part_mb
+	 * MiB (PART_BUDGET_MB if 0). Only the count queries are supported,
+	 * from one thread at a time, with the tree backend and without pairs,
+	 * images or updates. The peak memory used is reported by fpt_cleanup.
+	 */
+	const char *part_dir;
+	size_t part_mb;
+	/**
+	 * Fraction of the transactions to keep, all if 0 or 1. Each line of a
+	 * text transaction file is kept with this probability, from a hash of
+	 * its offset and sample_seed, and the tree holds the counts of the
+	 * sample: divided by fp->q, they estimate those of the input. Loading
+	 * costs about that fraction of a full load. Compressed inputs read by
+	 * several threads are sampled differently from one run to another.
+	 */
+	double sample;
+	long sample_seed;
 };
 
 /**
  * Read a transaction file and construct a fp-tree from it.
  */
-void fpt_read_from_file(const char *fname, struct fptree *fp);
+void fpt_read_from_file(const char *fname, struct fptree *fp,
+		const struct fpt_options *opts);
+
+/**
+ * Save the transactions in the fp-tree to a binary transaction file.
+ *
+ * Binary files are recognized by fpt_read_from_file and are loaded without
+ * parsing the text or computing the item counts again.
+ */
+void fpt_save_binary(const struct fptree *fp, const char *fname);
+
+/**
+ * Add w copies (w > 0) of the transaction of the len items (between 1 and
+ * n), or remove -w copies of it (w < 0), in a tree loaded with updatable
+ * set. It costs O(len) and returns -1, changing nothing, for an unknown or
+ * repeated item or a transaction not in the tree that often. The tree holds
+ * the transactions without the items dropped by opts->select, and the ones
+ * left with no item are only counted, all together.
+ *
+ * The items are those of the file loaded and the ones added since by
+ * fpt_update_ids, which takes the ids of the transaction file in place of
+ * the items. Adding a transaction with an id not seen yet adds an item for
+ * it, kept in the tree whatever opts->select, with the last rank until the
+ * items are ranked again. A window sliding over a stream can thus start
+ * from any file of it.
+ *
+ * The counts see the updates at the next fpt_refresh, at a cost growing
+ * with the updates and not with the tree: nodes get their new counts in
+ * place, emptied ones are kept with a count of 0 and new ones are added
+ * at the end of their chains, the bitmaps getting the added transactions
+ * in spare bits. Once FPT_SLACK of the nodes or of the bits are used, the
+ * tree is frozen or the bitmaps built again. Until then, prefixes are not
+ * projected on the nodes added. The backend and the items of the pair
+ * matrix are the ones picked once loaded. Items are ranked again once
+ * the counts by which neighbouring ranks are out of order add up to more
+ * than FPT_DRIFT of the counts of all the items, so ranks and prefixes
+ * from before a fpt_refresh must not be used after it.
+ */
+int fpt_update(struct fptree *fp, const int *items, int len, int w);
+int fpt_update_ids(struct fptree *fp, const size_t *ids, int len, int w);
+void fpt_refresh(struct fptree *fp);
 
 /**
  * Cleanup the data structures used in a fp-tree.
@@ -36,9 +166,79 @@ void fpt_cleanup(const struct fptree *fp);
 int fpt_height(const struct fptree *fp);
 int fpt_nodes(const struct fptree *fp);
 
+/**
+ * Print the shape of the tree, to tune the backend and the number of items
+ * mined: the distribution of the chain lengths, the nodes a count walks
+ * for each last item (on all of them, weighted by count and on the first
+ * ni ranks), the fan-out at each depth and the memory of each part.
+ * Returns the heap used by the tree, in bytes.
+ */
+size_t fpt_profile(const struct fptree *fp, size_t ni);
+
+/**
+ * Returns the id in the transaction file of item it (between 1 and n).
+ */
+size_t fpt_item_id(const struct fptree *fp, int it);
+
+/**
+ * Returns the item of the id id of the transaction file, 0 if it has none.
+ */
+int fpt_id_item(const struct fptree *fp, size_t id);
+
 int fpt_item_count(const struct fptree *fp, int it);
 int fpt_itemset_count(const struct fptree *fp, const int *its, int itslen);
 
+/**
+ * Rank space: items numbered from 0 in decreasing order of their counts,
+ * the order used inside the tree.
+ */
+int fpt_item_rank(const struct fptree *fp, int it);
+int fpt_rank_item(const struct fptree *fp, int r);
+int fpt_rank_count(const struct fptree *fp, int r);
+
+/**
+ * Count of the itemset given by its ranks, sorted in increasing order,
+ * without duplicates and with len > 0. Unlike fpt_itemset_count it does
+ * not allocate or sort.
+ */
+int fpt_rankset_count(const struct fptree *fp, const int *rs, int len);
+
+/**
+ * Counts of n itemsets at once, itemset i being the len[i] ranks in rs[i]
+ * as for fpt_rankset_count. Itemsets with the same last rank are counted
+ * in a single pass over its chain.
+ */
+void fpt_ranksets_count(const struct fptree *fp, const int *const *rs,
+		const int *len, size_t n, int *counts);
+
+/**
+ * Counts of all the 2^len subsets of the len sorted ranks in rs at once:
+ * counts[m] for the ranks rs[i] with bit i set in m, counts[0] being the
+ * number of transactions. Costs a single pass over the chain of each rank,
+ * instead of one per subset.
+ */
+void fpt_lattice_count(const struct fptree *fp, const int *rs, int len,
+		int *counts);
+
+/**
+ * A prefix itemset, extended one rank at a time (p NULL being the empty
+ * prefix), to count many extensions of it. The bitmap backend keeps the
+ * transactions of the prefix so an extension costs a single AND. The tree
+ * backend keeps the nodes of its last rank whose path holds it, projected
+ * from those of p, so its extensions are counted on their paths and in
+ * their subtrees only, fewer at each level.
+ */
+struct fpt_prefix *fpt_prefix_new(const struct fptree *fp,
+		const struct fpt_prefix *p, int r);
+void fpt_prefix_free(struct fpt_prefix *p);
+
+/**
+ * Counts of the prefix p extended with each of the n ranks in rs, none of
+ * them in p already.
+ */
+void fpt_prefix_count(const struct fptree *fp, const struct fpt_prefix *p,
+		const int *rs, size_t n, int *counts);
+
 /** Debug printing. */
 void fpt_tree_print(const struct fptree *fp);
 void fpt_table_print(const struct fptree *fp);
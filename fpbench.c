@@ -0,0 +1,84 @@
+/**
+ * Benchmark for building the fp-tree with increasing number of threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "fp.h"
+#include "globals.h"
+
+#define MICROSECONDS 1000000L
+
+/* Command line arguments */
+static struct {
+	/* filename containing the transactions */
+	char *tfname;
+	/* maximum number of threads to try */
+	size_t maxthreads;
+} args;
+
+static void usage(const char *prg)
+{
+	fprintf(stderr, "Usage: %s TFILE MAXTHREADS\n", prg);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_arguments(int argc, char **argv)
+{
+	if (argc != 3)
+		usage(argv[0]);
+	args.tfname = strdup(argv[1]);
+	if (sscanf(argv[2], "%lu", &args.maxthreads) != 1 || !args.maxthreads)
+		usage(argv[0]);
+}
+
+static double build_once(size_t threads, size_t *t, int *nodes)
+{
+	struct fpt_options fpo = { .threads = threads };
+	struct timeval starttime, endtime;
+	struct fptree fp;
+
+	gettimeofday(&starttime, NULL);
+	fpt_read_from_file(args.tfname, &fp, &fpo);
+	gettimeofday(&endtime, NULL);
+
+	*t = fp.t;
+	*nodes = fpt_nodes(&fp);
+	fpt_cleanup(&fp);
+
+	return endtime.tv_sec - starttime.tv_sec +
+		(0.0 + endtime.tv_usec - starttime.tv_usec) / MICROSECONDS;
+}
+
+int main(int argc, char **argv)
+{
+	size_t threads, *ts, i, n = 0, t;
+	double *secs;
+	int nodes;
+
+	parse_arguments(argc, argv);
+
+	ts = calloc(2 * args.maxthreads, sizeof(ts[0]));
+	secs = calloc(2 * args.maxthreads, sizeof(secs[0]));
+	for (threads = 1; ; threads *= 2) {
+		threads = min(threads, args.maxthreads);
+		ts[n] = threads;
+		secs[n++] = build_once(threads, &t, &nodes);
+		printf("fp-tree: transactions: %lu, nodes: %d\n", t, nodes);
+		if (threads == args.maxthreads)
+			break;
+	}
+
+	printf("%8s %10s %16s\n", "threads", "seconds", "transactions/s");
+	for (i = 0; i < n; i++)
+		printf("%8lu %10.3lf %16.0lf\n", ts[i], secs[i],
+				div_or_zero(t, secs[i]));
+
+	free(ts);
+	free(secs);
+	free(args.tfname);
+	return 0;
+}
@@ -0,0 +1,429 @@
+/**
+ * Check of the fp-tree updates: slides a window over the transactions of
+ * a file with fpt_update and fpt_refresh, then compares the counts of the
+ * updated tree with those of a tree built from the transactions left.
+ * Without a file, it makes one up from random transactions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fp.h"
+#include "globals.h"
+
+/* updates between two refreshes */
+#define REFRESH_EVERY 50
+/* most frequent ranks the itemsets checked are drawn from */
+#define CHECK_RANKS 24
+#define CHECK_SETS 4000
+/* ids added by the updates, none of them dropped */
+#define UNSEEN_ID 100000001
+#define UNSEEN_IDS 4
+
+/* Command line arguments */
+static struct {
+	enum fpt_backend backend;
+	/* filename containing the transactions, NULL to make one up */
+	char *tfname;
+} args;
+
+/* the transactions of the window, each w[i] times */
+static struct {
+	size_t **ids;
+	int *len;
+	int *w;
+	size_t n, sz;
+} win;
+
+static void usage(const char *prg)
+{
+	fprintf(stderr, "Usage: %s tree|bitmap [TFILE]\n", prg);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_arguments(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3)
+		usage(argv[0]);
+	if (!strcmp(argv[1], "tree"))
+		args.backend = FPT_TREE;
+	else if (!strcmp(argv[1], "bitmap"))
+		args.backend = FPT_BITMAP;
+	else
+		usage(argv[0]);
+	args.tfname = argc > 2 ? strdup(argv[2]) : NULL;
+}
+
+static int size_cmp(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* add the len ids (sorted, without duplicates) to the window, w times */
+static void window_add(size_t *ids, int len, int w)
+{
+	if (win.n == win.sz) {
+		win.sz = win.sz ? 2 * win.sz : 1024;
+		win.ids = realloc(win.ids, win.sz * sizeof(win.ids[0]));
+		win.len = realloc(win.len, win.sz * sizeof(win.len[0]));
+		win.w = realloc(win.w, win.sz * sizeof(win.w[0]));
+	}
+	win.ids[win.n] = ids;
+	win.len[win.n] = len;
+	win.w[win.n++] = w;
+}
+
+static void read_window(const char *fname)
+{
+	FILE *f = fopen(fname, "r");
+	char *line = NULL, *p, *q;
+	size_t sz = 0, *ids, x;
+	int len;
+
+	if (!f)
+		die("Unable to open %s", fname);
+	while (getline(&line, &sz, f) > 0) {
+		ids = calloc(strlen(line) / 2 + 1, sizeof(ids[0]));
+		for (p = line, len = 0; (x = strtoul(p, &q, 10)) && q != p; p = q)
+			ids[len++] = x;
+		qsort(ids, len, sizeof(ids[0]), size_cmp);
+		window_add(ids, len, 1);
+	}
+	free(line);
+	fclose(f);
+}
+
+static void write_window(const char *fname)
+{
+	FILE *f = fopen(fname, "w");
+	size_t i;
+	int j, k;
+
+	if (!f)
+		die("Unable to save file %s", fname);
+	for (i = 0; i < win.n; i++)
+		for (k = 0; k < win.w[i]; k++) {
+			for (j = 0; j < win.len[i]; j++)
+				fprintf(f, "%s%lu", j ? " " : "", win.ids[i][j]);
+			fprintf(f, "\n");
+		}
+	if (fclose(f))
+		die("Unable to save file %s", fname);
+}
+
+/* transactions of skewed items with sparse ids, so ids and items differ */
+static void make_input(const char *fname, size_t n)
+{
+	FILE *f = fopen(fname, "w");
+	size_t i;
+	int k, it;
+
+	if (!f)
+		die("Unable to save file %s", fname);
+	srand(7);
+	for (i = 0; i < n; i++) {
+		for (k = 0, it = 0; k < 12; k++) {
+			it += 1 + rand() % (1 + k * k);
+			if (rand() % 3)
+				fprintf(f, "%s%d", k ? " " : "", 10 * it + 3);
+		}
+		fprintf(f, "\n");
+	}
+	if (fclose(f))
+		die("Unable to save file %s", fname);
+}
+
+/* ids dropped from the tree by its projection, one in 8 */
+static int dropped(size_t id)
+{
+	return id * 2654435761u % 8 == 5;
+}
+
+/* keep the items whose id is not dropped */
+static size_t select_items(const struct fptree *fp, int *keep, void *arg)
+{
+	size_t it, k = 0;
+
+	(void)arg;
+	for (it = 1; it <= fp->n; it++)
+		if (!dropped(fpt_item_id(fp, it)))
+			keep[k++] = it;
+	return k;
+}
+
+/* copies in the window of the transactions of dropped ids only */
+static int copies_dropped(void)
+{
+	size_t i;
+	int j, c = 0;
+
+	for (i = 0; i < win.n; i++) {
+		for (j = 0; j < win.len[i] && dropped(win.ids[i][j]); j++);
+		if (j == win.len[i])
+			c += win.w[i];
+	}
+	return c;
+}
+
+/**
+ * Union of two sorted transactions, in a new one, with an id of none of
+ * the loaded items for one union in two: one of UNSEEN_IDS above them all.
+ */
+static size_t *merge_ids(size_t i, size_t j, int *len)
+{
+	size_t *ids = calloc(win.len[i] + win.len[j] + 2, sizeof(ids[0]));
+	int a = 0, b = 0;
+
+	for (*len = 0; a < win.len[i] || b < win.len[j]; ) {
+		if (b == win.len[j] || (a < win.len[i] &&
+					win.ids[i][a] < win.ids[j][b]))
+			ids[(*len)++] = win.ids[i][a++];
+		else if (a == win.len[i] || win.ids[j][b] < win.ids[i][a])
+			ids[(*len)++] = win.ids[j][b++];
+		else {
+			ids[(*len)++] = win.ids[i][a++];
+			b++;
+		}
+	}
+	if (i % 2)
+		ids[(*len)++] = UNSEEN_ID + 8 * (i / 2 % UNSEEN_IDS);
+	return ids;
+}
+
+/* whether entries i and j have the same ids not dropped */
+static int same_kept(size_t i, size_t j)
+{
+	int a = 0, b = 0;
+
+	for (;;) {
+		for (; a < win.len[i] && dropped(win.ids[i][a]); a++);
+		for (; b < win.len[j] && dropped(win.ids[j][b]); b++);
+		if (a == win.len[i] || b == win.len[j])
+			return a == win.len[i] && b == win.len[j];
+		if (win.ids[i][a++] != win.ids[j][b++])
+			return 0;
+	}
+}
+
+/**
+ * Copies in the window of the transaction of entry j, under any entry: the
+ * tree holds the transactions without their dropped items.
+ */
+static int copies(size_t j)
+{
+	size_t i;
+	int c = 0;
+
+	for (i = 0; i < win.n; i++)
+		if (same_kept(i, j))
+			c += win.w[i];
+	return c;
+}
+
+/**
+ * Slide the window: remove each transaction of the file in turn and add
+ * the union of two, with weights from 1 to 3, removing some again later.
+ * Returns the number of updates that failed.
+ */
+static int slide(struct fptree *fp, size_t n0)
+{
+	size_t k, j, nu = 0, unseen[2] = { UNSEEN_ID - 8, UNSEEN_ID - 8 };
+	int bad = 0, len, w, bogus = 0;
+	size_t *ids;
+
+	for (k = 0; k < n0; k++) {
+		bad += fpt_update_ids(fp, win.ids[k], win.len[k], -1) != 0;
+		win.w[k]--;
+
+		ids = merge_ids(k, (7 * k + 1) % n0, &len);
+		w = 1 + k % 3;
+		bad += fpt_update_ids(fp, ids, len, w) != 0;
+		window_add(ids, len, w);
+
+		j = n0 + (k * 13) % (win.n - n0);
+		if (k % 3 == 0 && win.w[j] >= 2) {
+			bad += fpt_update_ids(fp, win.ids[j], win.len[j], -2) != 0;
+			win.w[j] -= 2;
+		}
+		/* removing more copies than there are is refused */
+		bad += fpt_update_ids(fp, win.ids[j], win.len[j],
+				-copies(j) - 1) != -1;
+		if (fpt_update(fp, &bogus, 1, 1) != -1)
+			bad++;
+		/* nor is an unseen id removed or repeated, nor its item added */
+		bad += fpt_update_ids(fp, unseen, 1, -1) != -1;
+		bad += fpt_update_ids(fp, unseen, 2, 1) != -1;
+		bad += fpt_id_item(fp, unseen[0]) != 0;
+
+		if (++nu % REFRESH_EVERY == 0)
+			fpt_refresh(fp);
+	}
+
+	/**
+	 * Transactions in no node, empty or of dropped items only, are checked
+	 * against the count of all of them.
+	 */
+	for (k = 0; k < fp->n && !dropped(fpt_item_id(fp, k + 1)); k++);
+	for (len = 0; len < (k < fp->n ? 2 : 1); len++) {
+		ids = calloc(1, sizeof(ids[0]));
+		ids[0] = len ? fpt_item_id(fp, k + 1) : 0;
+		bad += fpt_update_ids(fp, ids, len, 2) != 0;
+		window_add(ids, len, 2);
+		bad += fpt_update_ids(fp, ids, len, -copies_dropped() - 1) != -1;
+		bad += fpt_update_ids(fp, ids, len, -1) != 0;
+		win.w[win.n - 1]--;
+	}
+	fpt_refresh(fp);
+
+	/* the least frequent item becoming the most frequent ranks them again */
+	if (fp->n > 1) {
+		ids = calloc(1, sizeof(ids[0]));
+		ids[0] = fpt_item_id(fp, fpt_rank_item(fp, fp->n - 1));
+		w = 2 * fpt_rank_count(fp, 0);
+		bad += fpt_update_ids(fp, ids, 1, w) != 0;
+		bad += fpt_update_ids(fp, ids, 1, -w / 2) != 0;
+		window_add(ids, 1, w - w / 2);
+		fpt_refresh(fp);
+	}
+	return bad;
+}
+
+/* count in fresh of the itemset of the len items its of fp */
+static int fresh_count(const struct fptree *fp, const struct fptree *fresh,
+		const int *its, int len)
+{
+	int q[CHECK_RANKS], i;
+
+	for (i = 0; i < len; i++)
+		if (!(q[i] = fpt_id_item(fresh, fpt_item_id(fp, its[i]))))
+			return 0;
+	return fpt_itemset_count(fresh, q, len);
+}
+
+/**
+ * Compare the counts of the items, of random itemsets of the most frequent
+ * items (alone, in lattices and as extensions of prefixes) of fp with the
+ * ones of fresh. Returns the number of counts that differ.
+ */
+static int compare(const struct fptree *fp, const struct fptree *fresh)
+{
+	int its[8], rs[8], cnt[256], all[CHECK_RANKS], ext[CHECK_RANKS];
+	int i, j, k, l, m, nr, bad = 0, q[8];
+	struct fpt_prefix *p;
+	size_t it;
+
+	bad += fp->t != fresh->t;
+	for (it = 1; it <= fp->n; it++) {
+		i = fpt_id_item(fresh, fpt_item_id(fp, it));
+		bad += fpt_item_count(fp, it - 1) !=
+			(i ? fpt_item_count(fresh, i - 1) : 0);
+	}
+
+	nr = fp->n < CHECK_RANKS ? (int)fp->n : CHECK_RANKS;
+	srand(11);
+	for (k = 0; k < CHECK_SETS && nr > 0; k++) {
+		/* l distinct ranks, sorted */
+		l = 1 + rand() % (nr < 6 ? nr : 6);
+		for (i = 0; i < l; i++) {
+again:
+			rs[i] = rand() % nr;
+			for (j = 0; j < i; j++)
+				if (rs[j] == rs[i])
+					goto again;
+		}
+		for (i = 1; i < l; i++)
+			for (j = i; j > 0 && rs[j - 1] > rs[j]; j--) {
+				m = rs[j];
+				rs[j] = rs[j - 1];
+				rs[j - 1] = m;
+			}
+		for (i = 0; i < l; i++)
+			its[i] = fpt_rank_item(fp, rs[i]);
+
+		bad += fpt_itemset_count(fp, its, l) !=
+			fresh_count(fp, fresh, its, l);
+
+		fpt_lattice_count(fp, rs, l, cnt);
+		for (m = 1; m < 1 << l; m++) {
+			for (i = 0, j = 0; i < l; i++)
+				if (m >> i & 1)
+					q[j++] = its[i];
+			bad += cnt[m] != fresh_count(fp, fresh, q, j);
+		}
+
+		/* the prefix of the ranks of the set, extended with the others */
+		for (i = 0, p = NULL; i < l; i++) {
+			struct fpt_prefix *np = fpt_prefix_new(fp, p, rs[i]);
+
+			if (p)
+				fpt_prefix_free(p);
+			p = np;
+		}
+		for (j = 0, m = 0; j < nr; j++) {
+			for (i = 0; i < l && rs[i] != j; i++);
+			if (i == l)
+				ext[m++] = j;
+		}
+		fpt_prefix_count(fp, p, ext, m, all);
+		for (j = 0; j < m && l < 8; j++) {
+			its[l] = fpt_rank_item(fp, ext[j]);
+			bad += all[j] != fresh_count(fp, fresh, its, l + 1);
+		}
+		fpt_prefix_free(p);
+	}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	struct fpt_options fpo = { .threads = 1, .updatable = 1, .pairs = 8,
+		.select = select_items };
+	char tmp[] = "/tmp/fpupdateXXXXXX", made[] = "/tmp/fpupdateXXXXXX";
+	struct fptree fp, fresh;
+	int bad, fd;
+	size_t n0, i;
+
+	parse_arguments(argc, argv);
+	if (!args.tfname) {
+		if ((fd = mkstemp(made)) < 0)
+			die("Unable to create a temporary file");
+		close(fd);
+		make_input(made, 3000);
+		args.tfname = strdup(made);
+	}
+
+	fpo.backend = args.backend;
+	fpt_read_from_file(args.tfname, &fp, &fpo);
+	read_window(args.tfname);
+	n0 = win.n;
+	bad = slide(&fp, n0);
+	printf("Updates: %lu transactions slid, %d refused wrongly\n", n0, bad);
+
+	if ((fd = mkstemp(tmp)) < 0)
+		die("Unable to create a temporary file");
+	close(fd);
+	write_window(tmp);
+	fpo.updatable = 0;
+	fpt_read_from_file(tmp, &fresh, &fpo);
+	bad += compare(&fp, &fresh);
+	unlink(tmp);
+	if (!strcmp(args.tfname, made))
+		unlink(made);
+
+	printf("%s: %d counts differ from a fresh build, %d nodes against %d\n",
+			bad ? "FAILED" : "OK", bad, fpt_nodes(&fp),
+			fpt_nodes(&fresh));
+
+	fpt_cleanup(&fp);
+	fpt_cleanup(&fresh);
+	for (i = 0; i < win.n; i++)
+		free(win.ids[i]);
+	free(win.ids);
+	free(win.len);
+	free(win.w);
+	free(args.tfname);
+	return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
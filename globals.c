@@ -14,6 +14,32 @@ void init_rng(long int seed, struct drand48_data *buffer)
 	srand48_r(seed, buffer);
 }
 
+/* splitmix64 finalizer */
+static unsigned long mix64(unsigned long x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9UL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebUL;
+	return x ^ (x >> 31);
+}
+
+unsigned long rng_key(unsigned long key, unsigned long i)
+{
+	return mix64(key + (i + 1) * 0x9e3779b97f4a7c15UL);
+}
+
+void init_rng_stream(unsigned long key, struct drand48_data *buffer)
+{
+	unsigned short x[3];
+
+	key = mix64(key);
+	x[0] = key;
+	x[1] = key >> 16;
+	x[2] = key >> 32;
+	seed48_r(x, buffer);
+}
+
 int int_cmp(const void *a, const void *b)
 {
 	const int *ia = a, *ib = b;
@@ -35,6 +35,14 @@ int double_cmp_r(const void *a, const void *b);
 
 void init_rng(long int seed, struct drand48_data *buffer);
 
+/**
+ * Independent generators: the key of the i-th stream derived from key, and
+ * the generator of the stream of key (seeded with 48 bits of its hash).
+ * The streams depend only on the keys, not on the order they are used in.
+ */
+unsigned long rng_key(unsigned long key, unsigned long i);
+void init_rng_stream(unsigned long key, struct drand48_data *buffer);
+
 /* Laplace mechanism */
 double laplace_mechanism(double x, double eps, double sens,
 		struct drand48_data *buffer);
@@ -234,3 +234,12 @@ void itstree_count_priv(const struct itstree_node *itst,
 {
 	do_count(itst, p30, p50, p70, 1);
 }
+
+size_t itstree_bytes(const struct itstree_node *itst)
+{
+	size_t i, ret = sizeof(*itst) + itst->sp * sizeof(itst->children[0]);
+
+	for (i = 0; i < itst->sz; i++)
+		ret += itstree_bytes(itst->children[i].iptr);
+	return ret;
+}
@@ -1,5 +1,8 @@
 /**
  * Tree of itemsets (for recall and duplicate removal).
+ *
+ * Itemsets are sorted ids of the transaction file, so the trees saved by
+ * cr and the ones of dph agree whatever items each of them has loaded.
  */
 #ifndef _ITSTREE_H
 #define _ITSTREE_H
@@ -27,5 +30,8 @@ void itstree_count_real(const struct itstree_node *itst,
 void itstree_count_priv(const struct itstree_node *itst,
 		size_t *p30, size_t *p50, size_t *p70);
 
+/* heap used by the tree, in bytes */
+size_t itstree_bytes(const struct itstree_node *itst);
+
 #endif
 
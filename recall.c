@@ -7,6 +7,7 @@
 #include "recall.h"
 
 struct item_count {
+	/* rank of the item in fp */
 	int value;
 	int real_count;
 };
@@ -22,7 +23,7 @@ static void build_items_table(const struct fptree *fp, struct item_count *ic)
 	size_t i;
 
 	for (i = 0; i < fp->n; i++) {
-		ic[i].value = i + 1;
+		ic[i].value = fpt_item_rank(fp, i + 1);
 		ic[i].real_count = fpt_item_count(fp, i);
 	}
 
@@ -40,38 +41,63 @@ static size_t ic_search(const struct item_count *ic, size_t n, int x)
 	die("Invalid value in ic_search");
 }
 
+/**
+ * AB holds ranks. Its subsets are counted as sorted ranks and it is
+ * recorded as sorted ids of the transaction file, which do not depend on
+ * the items the tree was built from.
+ */
 static void generate_rules_from_itemset(const int *AB, size_t ab_length,
 		const struct fptree *fp, struct itstree_node *itst)
 {
 	size_t i, j, max, a_length, rc30, rc50, rc70;
 	int *cf = calloc(ab_length, sizeof(cf[0]));
-	int *A = calloc(ab_length, sizeof(A[0]));
-	int sup_ab, sup_a;
+	int sup_ab, x, *A, *sets, *lens, *sups;
+	const int **rs;
 	double c;
 
+	for (i = 0; i < ab_length; i++) {
+		x = AB[i];
+		for (j = i; j > 0 && cf[j - 1] > x; j--)
+			cf[j] = cf[j - 1];
+		cf[j] = x;
+	}
+
+	/* count AB and all its subsets in one batch */
 	max = (1 << ab_length) - 1;
-	rc30 = rc50 = rc70 = 0;
-	sup_ab = fpt_itemset_count(fp, AB, ab_length);
-	for (i = 1; i < max; i++) {
+	sets = calloc(max * ab_length, sizeof(sets[0]));
+	rs = calloc(max, sizeof(rs[0]));
+	lens = calloc(max, sizeof(lens[0]));
+	sups = calloc(max, sizeof(sups[0]));
+	for (i = 1; i <= max; i++) {
+		A = sets + (i - 1) * ab_length;
 		a_length = 0;
 		for (j = 0; j < ab_length; j++)
 			if (i & (1 << j))
-				A[a_length++] = AB[j];
+				A[a_length++] = cf[j];
+		rs[i - 1] = A;
+		lens[i - 1] = a_length;
+	}
+	fpt_ranksets_count(fp, rs, lens, max, sups);
 
-		sup_a = fpt_itemset_count(fp, A, a_length);
-		c = div_or_zero(sup_ab, sup_a);
+	rc30 = rc50 = rc70 = 0;
+	sup_ab = sups[max - 1];
+	for (i = 1; i < max; i++) {
+		c = div_or_zero(sup_ab, sups[i - 1]);
 		if (c > .3) rc30++;
 		if (c > .5) rc50++;
 		if (c > .7) rc70++;
 	}
 
 	for (i = 0; i < ab_length; i++)
-		cf[i] = AB[i];
+		cf[i] = fpt_item_id(fp, fpt_rank_item(fp, AB[i]));
 	qsort(cf, ab_length, sizeof(cf[0]), int_cmp);
 	record_its(itst, cf, ab_length, rc30, rc50, rc70);
 
 	free(cf);
-	free(A);
+	free(sets);
+	free(rs);
+	free(lens);
+	free(sups);
 }
 
 static void generate(const struct fptree *fp, const struct item_count *ic,
@@ -107,6 +133,19 @@ static void generate_itemsets(const struct fptree *fp,
 	free(AB);
 }
 
+size_t recall_top_items(const struct fptree *fp, size_t ni, int *items)
+{
+	struct item_count *ic = calloc(fp->n + 1, sizeof(ic[0]));
+	size_t i, n = min(ni, fp->n);
+
+	build_items_table(fp, ic);
+	for (i = 0; i < n; i++)
+		items[i] = fpt_rank_item(fp, ic[i].value);
+
+	free(ic);
+	return n;
+}
+
 struct itstree_node * build_recall_tree(const struct fptree *fp,
 		size_t lmax, size_t ni)
 {
@@ -10,4 +10,10 @@ struct itstree_node;
 struct itstree_node * build_recall_tree(const struct fptree *fp,
 		size_t lmax, size_t ni);
 
+/**
+ * Store in items the ni most frequent items, the ones the recall tree is
+ * built from, and return their number.
+ */
+size_t recall_top_items(const struct fptree *fp, size_t ni, int *items);
+
 #endif
@@ -52,6 +52,11 @@ void free_reservoir(struct reservoir *r)
 	free(r);
 }
 
+size_t reservoir_bytes(size_t sz)
+{
+	return sizeof(struct reservoir) + sz * sizeof(struct reservoir_item);
+}
+
 static inline double generate_random_uniform(struct drand48_data *randbuffer)
 {
 	double u;
@@ -129,12 +134,21 @@ void add_to_reservoir(struct reservoir *r, const void *it,
 	store_item(r, it, w, u, v);
 }
 
+double reservoir_log_key(double logw, double u)
+{
+	return log(log(1/u)) - logw;
+}
+
 void add_to_reservoir_log(struct reservoir *r, const void *it,
 		double logw, struct drand48_data *randbuffer)
 {
-	double u = generate_random_uniform(randbuffer);
-	double v = log(log(1/u)) - logw;
-	store_item(r, it, logw, u, v);
+	add_to_reservoir_log_u(r, it, logw, generate_random_uniform(randbuffer));
+}
+
+void add_to_reservoir_log_u(struct reservoir *r, const void *it,
+		double logw, double u)
+{
+	store_item(r, it, logw, u, reservoir_log_key(logw, u));
 }
 
 struct reservoir_iterator *init_reservoir_iterator(struct reservoir *r)
@@ -25,6 +25,11 @@ struct reservoir *init_reservoir(size_t sz,
 		void (*free_fun)(void *it));
 void free_reservoir(struct reservoir *r);
 
+/**
+ * Heap used by a reservoir of sz items, without the items themselves.
+ */
+size_t reservoir_bytes(size_t sz);
+
 /**
  * Add item to reservoir using weight (log weight).
  */
@@ -33,6 +38,16 @@ void add_to_reservoir(struct reservoir *r, const void *it,
 void add_to_reservoir_log(struct reservoir *r, const void *it,
 		double logw, struct drand48_data *randbuffer);
 
+/**
+ * Add item to reservoir using log weight and the uniform u drawn for it.
+ * The items kept are the ones of lowest key, from reservoir_log_key: as
+ * it decreases with logw, a bound on logw bounds the key of an item from
+ * below, before its weight is known.
+ */
+void add_to_reservoir_log_u(struct reservoir *r, const void *it,
+		double logw, double u);
+double reservoir_log_key(double logw, double u);
+
 struct reservoir_iterator *init_reservoir_iterator(struct reservoir *r);
 void free_reservoir_iterator(struct reservoir_iterator *ri);
 
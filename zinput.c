@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "globals.h"
+#include "zinput.h"
+
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/* size of a decompressed block, grown only for longer lines */
+#define BLOCK_SIZE (1 << 20)
+/* number of blocks decompressed ahead of the parsers */
+#define QUEUE_SIZE 4
+/* largest input handed to zlib at once (avail_in is 32 bits) */
+#define ZLIB_CHUNK (1U << 30)
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+struct zstream {
+	enum zformat zf;
+	/* compressed input */
+	const unsigned char *src;
+	size_t sz, pos;
+	/* decompressor state */
+	z_stream z;
+#if WITH_ZSTD
+	ZSTD_DStream *ds;
+	size_t last;
+#endif
+	int eof;
+	/* queue of decompressed blocks */
+	pthread_t th;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *blk[QUEUE_SIZE];
+	size_t len[QUEUE_SIZE];
+	size_t head, count;
+	int done;
+};
+
+enum zformat zstream_format(const void *data, size_t sz)
+{
+	if (sz >= sizeof(gzip_magic) &&
+			!memcmp(data, gzip_magic, sizeof(gzip_magic)))
+		return ZF_GZIP;
+	if (sz >= sizeof(zstd_magic) &&
+			!memcmp(data, zstd_magic, sizeof(zstd_magic)))
+		return ZF_ZSTD;
+	return ZF_NONE;
+}
+
+/**
+ * Decompress into out as much as possible, up to cap bytes.
+ */
+static size_t gzip_fill(struct zstream *zs, char *out, size_t cap)
+{
+	int ret;
+
+	zs->z.next_out = (unsigned char *)out;
+	zs->z.avail_out = cap;
+
+	while (zs->z.avail_out && !zs->eof) {
+		if (!zs->z.avail_in && zs->pos < zs->sz) {
+			zs->z.next_in = (unsigned char *)zs->src + zs->pos;
+			zs->z.avail_in = min(zs->sz - zs->pos, (size_t)ZLIB_CHUNK);
+			zs->pos += zs->z.avail_in;
+		}
+
+		ret = inflate(&zs->z, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			/* concatenated gzip members */
+			if (zs->z.avail_in || zs->pos < zs->sz)
+				inflateReset(&zs->z);
+			else
+				zs->eof = 1;
+		} else if (ret != Z_OK)
+			die("Corrupted or truncated gzip input");
+	}
+
+	return cap - zs->z.avail_out;
+}
+
+#if WITH_ZSTD
+static size_t zstd_fill(struct zstream *zs, char *out, size_t cap)
+{
+	ZSTD_outBuffer ob = { out, cap, 0 };
+	ZSTD_inBuffer ib;
+	size_t before;
+
+	while (ob.pos < ob.size && !zs->eof) {
+		ib.src = zs->src;
+		ib.size = zs->sz;
+		ib.pos = zs->pos;
+		before = ob.pos;
+
+		zs->last = ZSTD_decompressStream(zs->ds, &ob, &ib);
+		if (ZSTD_isError(zs->last))
+			die("Corrupted zstd input: %s",
+					ZSTD_getErrorName(zs->last));
+		zs->pos = ib.pos;
+
+		if (zs->pos == zs->sz && ob.pos < ob.size) {
+			if (zs->last)
+				die("Truncated zstd input");
+			zs->eof = 1;
+		} else if (zs->pos == zs->sz && ob.pos == before)
+			zs->eof = 1;
+	}
+
+	return ob.pos;
+}
+#endif
+
+static size_t zstream_fill(struct zstream *zs, char *out, size_t cap)
+{
+#if WITH_ZSTD
+	if (zs->zf == ZF_ZSTD)
+		return zstd_fill(zs, out, cap);
+#endif
+	return gzip_fill(zs, out, cap);
+}
+
+static void zstream_put(struct zstream *zs, char *blk, size_t len)
+{
+	pthread_mutex_lock(&zs->lock);
+	while (zs->count == QUEUE_SIZE)
+		pthread_cond_wait(&zs->cond, &zs->lock);
+	zs->blk[(zs->head + zs->count) % QUEUE_SIZE] = blk;
+	zs->len[(zs->head + zs->count) % QUEUE_SIZE] = len;
+	zs->count++;
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
+}
+
+/**
+ * Producer: decompress into blocks of whole lines.
+ *
+ * The partial line at the end of a block is moved to the start of the
+ * next one, the block being grown when a single line does not fit.
+ */
+static void *zstream_produce(void *arg)
+{
+	size_t cap = BLOCK_SIZE, len = 0, keep;
+	struct zstream *zs = arg;
+	char *buf, *nbuf, *nl;
+
+	buf = malloc(cap);
+	while (1) {
+		len += zstream_fill(zs, buf + len, cap - len);
+		if (zs->eof)
+			break;
+
+		nl = memrchr(buf, '\n', len);
+		if (!nl) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			continue;
+		}
+
+		keep = buf + len - (nl + 1);
+		cap = max(cap, (size_t)BLOCK_SIZE);
+		nbuf = malloc(cap);
+		memcpy(nbuf, nl + 1, keep);
+		zstream_put(zs, buf, len - keep);
+		buf = nbuf;
+		len = keep;
+	}
+
+	if (len)
+		zstream_put(zs, buf, len);
+	else
+		free(buf);
+
+	pthread_mutex_lock(&zs->lock);
+	zs->done = 1;
+	pthread_cond_broadcast(&zs->cond);
+	pthread_mutex_unlock(&zs->lock);
+	return NULL;
+}
+
+struct zstream *zstream_open(const void *data, size_t sz, enum zformat zf)
+{
+	struct zstream *zs = calloc(1, sizeof(*zs));
+
+	zs->zf = zf;
+	zs->src = data;
+	zs->sz = sz;
+
+	switch (zf) {
+	case ZF_GZIP:
+		/* 32 added to window bits: detect gzip/zlib header */
+		if (inflateInit2(&zs->z, 15 + 32) != Z_OK)
+			die("Unable to initialize zlib");
+		break;
+	case ZF_ZSTD:
+#if WITH_ZSTD
+		zs->ds = ZSTD_createDStream();
+		if (!zs->ds || ZSTD_isError(ZSTD_initDStream(zs->ds)))
+			die("Unable to initialize zstd");
+		break;
+#else
+		die("zstd input needs a build with ZSTD=1");
+#endif
+	default:
+		die("Invalid compression format %d", zf);
+	}
+
+	pthread_mutex_init(&zs->lock, NULL);
+	pthread_cond_init(&zs->cond, NULL);
+	if (pthread_create(&zs->th, NULL, zstream_produce, zs))
+		die("Unable to start decompression thread");
+
+	return zs;
+}
+
+char *zstream_next(struct zstream *zs, size_t *len)
+{
+	char *ret = NULL;
+
+	pthread_mutex_lock(&zs->lock);
+	while (!zs->count && !zs->done)
+		pthread_cond_wait(&zs->cond, &zs->lock);
+	if (zs->count) {
+		ret = zs->blk[zs->head];
+		*len = zs->len[zs->head];
+		zs->head = (zs->head + 1) % QUEUE_SIZE;
+		zs->count--;
+		pthread_cond_broadcast(&zs->cond);
+	}
+	pthread_mutex_unlock(&zs->lock);
+
+	return ret;
+}
+
+void zstream_close(struct zstream *zs)
+{
+	char *blk;
+	size_t len;
+
+	/* drain what was not consumed so the producer can finish */
+	while ((blk = zstream_next(zs, &len)))
+		free(blk);
+	pthread_join(zs->th, NULL);
+
+	if (zs->zf == ZF_GZIP)
+		inflateEnd(&zs->z);
+#if WITH_ZSTD
+	if (zs->zf == ZF_ZSTD)
+		ZSTD_freeDStream(zs->ds);
+#endif
+	pthread_mutex_destroy(&zs->lock);
+	pthread_cond_destroy(&zs->cond);
+	free(zs);
+}
@@ -0,0 +1,43 @@
+/**
+ * Streaming decompression of transaction files.
+ */
+#ifndef _ZINPUT_H
+#define _ZINPUT_H
+
+/* compiled with zstd support */
+#ifndef WITH_ZSTD
+#define WITH_ZSTD 0
+#endif
+
+enum zformat {
+	ZF_NONE = 0,
+	ZF_GZIP,
+	ZF_ZSTD
+};
+
+struct zstream;
+
+/**
+ * Detect the compression format from the first bytes of the data.
+ */
+enum zformat zstream_format(const void *data, size_t sz);
+
+/**
+ * Start decompressing data in a separate thread.
+ *
+ * The input must stay valid until zstream_close.
+ */
+struct zstream *zstream_open(const void *data, size_t sz, enum zformat zf);
+
+/**
+ * Returns the next block of decompressed data or NULL at the end.
+ *
+ * Each block ends after a newline, except the last one which may end with
+ * an unterminated line. Can be called from multiple threads, the caller
+ * must free the returned block.
+ */
+char *zstream_next(struct zstream *zs, size_t *len);
+
+void zstream_close(struct zstream *zs);
+
+#endif